@@ -17,83 +17,11 @@
 #include <SDL3/SDL_timer.h>
 #include <SDL3/SDL_video.h>
 
-#define READALL_CHUNK (1024 * 128)
-#define READALL_NOMEM -1
-#define READALL_NFILE -2
-#define READALL_ERROR -3
-
 static SDL_Window *window     = NULL;
 static SDL_Renderer *renderer = NULL;
+static SDL_Texture *texture   = NULL;
 
-gusize current_frame = 0, num_frames = 0;
-
-struct animation_frame
-{
-  struct gif_image *image;
-  SDL_Texture *texture;
-} *frames = NULL;
-
-static int
-readall (const char *filename, char **buf, size_t *size)
-{
-  FILE *fp     = NULL;
-  char *tmpbuf = NULL, *tmpbuf2;
-  size_t tmpread, tmpsize = 0;
-
-  fp = fopen (filename, "rb");
-
-  if (fp == NULL)
-    return READALL_NFILE;
-
-  tmpbuf = malloc (READALL_CHUNK);
-
-  if (tmpbuf == NULL)
-    {
-      fclose (fp);
-      return READALL_NOMEM;
-    }
-
-  while ((tmpread = fread (tmpbuf + tmpsize, 1, READALL_CHUNK, fp))
-         == READALL_CHUNK)
-    {
-      tmpsize += READALL_CHUNK;
-      tmpbuf2 = realloc (tmpbuf, tmpsize + READALL_CHUNK);
-
-      if (tmpbuf2 == NULL)
-        {
-          free (tmpbuf);
-          fclose (fp);
-          return READALL_NOMEM;
-        }
-
-      tmpbuf = tmpbuf2;
-    }
-
-  tmpsize += tmpread;
-
-  if (feof (fp) == 0)
-    {
-      free (tmpbuf);
-      fclose (fp);
-      return READALL_ERROR;
-    }
-
-  tmpbuf2 = realloc (tmpbuf, tmpsize);
-
-  if (tmpbuf2 == NULL)
-    {
-      free (tmpbuf);
-      fclose (fp);
-      return READALL_NOMEM;
-    }
-
-  *buf  = tmpbuf2;
-  *size = tmpsize;
-
-  fclose (fp);
-
-  return 0;
-}
+static struct gif_compositor comp = { 0 };
 
 static int
 sdl_init (struct gif *gif)
@@ -119,68 +47,24 @@ sdl_init (struct gif *gif)
   SDL_SetRenderLogicalPresentation (renderer, gif->width, gif->height,
                                     SDL_LOGICAL_PRESENTATION_LETTERBOX);
 
-  frames = malloc (sizeof (struct animation_frame) * gif->num_images);
-
-  if (frames == NULL)
+  if (gif_compositor_init (&comp, gif))
     return -1;
 
-  for (gusize i = 0; i < gif->num_images; i++)
+  // one texture for the whole canvas, in the byte order of the compositor
+  texture = SDL_CreateTexture (renderer, SDL_PIXELFORMAT_RGBA32,
+                               SDL_TEXTUREACCESS_STREAMING, gif->width,
+                               gif->height);
+  if (texture == NULL)
     {
-      struct gif_image *image         = gif->images + i;
-      struct gif_color_table *palette = gif_image_get_palette (image);
-
-      if (!(image->flags & GIF_IMAGE_FLAG_FRAME))
-        continue;
-
-      struct animation_frame *frame = frames + num_frames++;
-
-      frame->image   = image;
-      frame->texture = SDL_CreateTexture (renderer, SDL_PIXELFORMAT_RGBA8888,
-                                          SDL_TEXTUREACCESS_TARGET,
-                                          image->width, image->height);
-      SDL_SetTextureScaleMode (frame->texture, SDL_SCALEMODE_NEAREST);
-      SDL_SetTextureBlendMode (frame->texture, SDL_BLENDMODE_BLEND);
-
-      SDL_SetRenderTarget (renderer, frame->texture);
-
-      gu32 transparent_index
-          = 0xFFFF; // set to out of bounds index unless exists
-      if (image->frame.flags & GIF_FRAME_FLAG_TRANSPARENT)
-        transparent_index = image->frame.transparent_index;
-
-      for (size_t i = 0; i < image->width * image->height; i++)
-        {
-          gu8 index = image->indices[i];
-          gu8 *comps;
-
-          if (index > palette->num_colors)
-            {
-              fprintf (stderr, "invalid GIF color index\n");
-              return -1;
-            }
-
-          if (index == palette->num_colors)
-            SDL_SetRenderDrawColor (renderer, 0, 0, 0, 0);
-          else if (index == transparent_index)
-            {
-              comps = palette->colors + 3 * index;
-              SDL_SetRenderDrawColor (renderer, comps[0], comps[1], comps[2],
-                                      0);
-            }
-          else
-            {
-              comps = palette->colors + 3 * index;
-              SDL_SetRenderDrawColor (renderer, comps[0], comps[1], comps[2],
-                                      255);
-            }
-
-          gu32 x = i % image->width;
-          gu32 y = i / image->width;
-          SDL_RenderPoint (renderer, x, y);
-        }
+      fprintf (stderr, "SDL3: failed to create texture\n");
+      return -1;
     }
 
-  SDL_SetRenderTarget (renderer, NULL);
+  SDL_SetTextureScaleMode (texture, SDL_SCALEMODE_NEAREST);
+  SDL_SetTextureBlendMode (texture, SDL_BLENDMODE_BLEND);
+
+  // later frames only upload what they change
+  SDL_UpdateTexture (texture, NULL, comp.canvas, gif->width * 4);
 
   return 0;
 }
@@ -188,13 +72,11 @@ sdl_init (struct gif *gif)
 static void
 sdl_cleanup (void)
 {
-  if (frames)
-    {
-      for (gusize i = 0; i < num_frames; i++)
-        SDL_DestroyTexture (frames[i].texture);
+  if (texture)
+    SDL_DestroyTexture (texture);
 
-      free (frames);
-    }
+  if (comp.canvas)
+    gif_compositor_free (&comp);
 
   if (renderer)
     SDL_DestroyRenderer (renderer);
@@ -220,35 +102,52 @@ sdl_draw_background (struct gif *gif)
 static void
 sdl_draw_frame (struct gif *gif)
 {
-  for (gusize i = 0; i <= current_frame; i++)
-    {
-      struct animation_frame *frame = frames + i;
-      gu8 disposal_method           = frame->image->frame.disposal_method;
+  sdl_draw_background (gif);
+  SDL_RenderTexture (renderer, texture, NULL, NULL);
+  SDL_RenderPresent (renderer);
+}
 
-      switch (disposal_method)
-        {
-        case GIF_FRAME_DISPOSE_ALL:
-          sdl_draw_background (gif);
-          break;
-        }
+// advances the compositor and uploads only what changed on the canvas
+static int
+sdl_next_frame (struct gif *gif)
+{
+  int pitch = gif->width * 4;
+  int result;
 
-      SDL_FRect dstrect = {
-        .x = frame->image->x,
-        .y = frame->image->y,
-        .w = frame->image->width,
-        .h = frame->image->height,
-      };
+  if ((result = gif_compositor_next (&comp)))
+    {
+      fprintf (stderr, "failed to draw frame: '%s'\n", gif_strerr (result));
+      return -1;
+    }
 
-      SDL_RenderTexture (renderer, frame->texture, NULL, &dstrect);
+  for (gu32 i = 0; i < comp.num_dirty; i++)
+    {
+      const struct gif_rect *dirty = comp.dirty + i;
+      SDL_Rect rect = { dirty->x, dirty->y, dirty->width, dirty->height };
+
+      SDL_UpdateTexture (texture, &rect,
+                         comp.canvas + (gusize) dirty->y * pitch
+                             + (gusize) dirty->x * 4,
+                         pitch);
     }
+
+  return 0;
+}
+
+// a delay of 0 would spin, browsers show such frames for 100 ms
+static Uint64
+sdl_frame_ms (struct gif *gif)
+{
+  gu16 delay = gif->images[comp.frame].frame.delay_time;
+
+  return delay ? delay * 10 : 100;
 }
 
 int
 main (int argc, const char *argv[])
 {
-  char *buf = NULL;
-  size_t size;
-  struct gif gif = { 0 };
+  struct gif_file file = { 0 };
+  struct gif gif      = { 0 };
 
   int test_mode        = 0;
   int retcode          = 0;
@@ -288,26 +187,15 @@ main (int argc, const char *argv[])
       goto exit;
     }
 
-  switch (readall (gif_path, &buf, &size))
+  int result = gif_parse_file (&gif, &file, gif_path, NULL);
+
+  if (result == GIF_ERR_IO)
     {
-    case 0:
-      break;
-    case READALL_NOMEM:
-      fprintf (stderr, "out of memory\n");
-      retcode = -1;
-      goto exit;
-    case READALL_NFILE:
       fprintf (stderr, "failed to open '%s'\n", gif_path);
       retcode = -1;
       goto exit;
-    default:
-      fprintf (stderr, "error occurred while reading '%s'\n", gif_path);
-      retcode = -1;
-      goto exit;
     }
 
-  int result = gif_parse (&gif, size, buf);
-
   if (result != GIF_SUCCESS)
     {
       fprintf (stderr, "failed to parse gif: '%s'\n", gif_strerr (result));
@@ -315,6 +203,9 @@ main (int argc, const char *argv[])
       goto exit;
     }
 
+  // parsed eagerly, nothing refers to the file anymore
+  gif_file_close (&file);
+
   if (test_mode)
     goto exit;
 
@@ -322,51 +213,63 @@ main (int argc, const char *argv[])
   int run = 1;
   Uint64 ticks;
 
+  // a still image never advances; without a NETSCAPE2.0 extension the
+  // animation plays once, and loop_count adds that many repeats, 0 forever
+  int playing = gif.num_images > 1;
+  gi32 loops  = gif.loop_count < 0 ? 0 : gif.loop_count;
+  int forever = gif.loop_count == 0;
+
   if ((retcode = sdl_init (&gif)))
     goto exit;
 
-  if (!num_frames)
-    {
-      fprintf (stderr, "no frames to present\n");
-      goto exit;
-    }
+  if ((retcode = sdl_next_frame (&gif)))
+    goto exit;
 
-  sdl_draw_background (&gif);
   sdl_draw_frame (&gif);
-  SDL_RenderPresent (renderer);
 
   ticks = SDL_GetTicks ();
 
+  // sleeps in SDL_WaitEventTimeout until an event or the next frame is due,
+  // or only until an event once playback is over
   while (run)
     {
-      while (SDL_PollEvent (&event) != 0)
+      Uint64 now = SDL_GetTicks (), due = ticks + sdl_frame_ms (&gif);
+
+      if (playing && now >= due && comp.frame == gif.num_images - 1
+          && !forever && !loops--)
+        playing = 0;
+
+      if (playing && now >= due)
         {
-          if (event.type == SDL_EVENT_QUIT)
-            run = 0;
-          else if (event.type == SDL_EVENT_WINDOW_EXPOSED)
-            {
-              sdl_draw_frame (&gif);
-              SDL_RenderPresent (renderer);
-            }
+          // keeps to the schedule unless a whole frame behind
+          ticks = now - due < sdl_frame_ms (&gif) ? due : now;
+
+          if ((retcode = sdl_next_frame (&gif)))
+            goto exit;
+
+          sdl_draw_frame (&gif);
+          continue;
         }
 
-      Uint64 ticks_now = SDL_GetTicks ();
+      if (!SDL_WaitEventTimeout (&event,
+                                 playing ? (Sint32) (due - now) : -1))
+        continue;
 
-      if (ticks_now - ticks
-          >= frames[current_frame].image->frame.delay_time * 10)
+      do
         {
-          ticks         = ticks_now;
-          current_frame = (current_frame + 1) % num_frames;
+          if (event.type == SDL_EVENT_QUIT)
+            run = 0;
+          else if (event.type == SDL_EVENT_WINDOW_EXPOSED
+                   || event.type == SDL_EVENT_WINDOW_RESIZED)
+            sdl_draw_frame (&gif);
         }
-
-      sdl_draw_frame (&gif);
-      SDL_RenderPresent (renderer);
+      while (SDL_PollEvent (&event));
     }
 
 exit:
   sdl_cleanup ();
   gif_free (&gif);
-  free (buf);
+  gif_file_close (&file);
 
   return retcode;
 }
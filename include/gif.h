@@ -24,13 +24,14 @@ typedef size_t gusize;
 #define GIF_ERR_EOF      -2
 #define GIF_ERR_BAD_DATA -3
 #define GIF_ERR_FAULT    -4
+#define GIF_ERR_IO       -5
+#define GIF_ERR_LIMIT    -6
 
 #define GIF_FLAG_GCT 1
 
-#define GIF_CODE_NO_PREFIX 0xFFFF
-
-#define GIF_IMAGE_FLAG_LCT   (1 << 0)
-#define GIF_IMAGE_FLAG_FRAME (1 << 1)
+#define GIF_IMAGE_FLAG_LCT        (1 << 0)
+#define GIF_IMAGE_FLAG_FRAME      (1 << 1)
+#define GIF_IMAGE_FLAG_INTERLACED (1 << 2)
 
 #define GIF_FRAME_FLAG_TRANSPARENT (1 << 0)
 #define GIF_FRAME_FLAG_USER_INPUT  (1 << 1)
@@ -39,21 +40,15 @@ typedef size_t gusize;
 #define GIF_FRAME_DISPOSE_ALL     2
 #define GIF_FRAME_DISPOSE_RESTORE 3
 
+#define GIF_PARSE_LAZY     (1 << 0)
+#define GIF_PARSE_VALIDATE (1 << 1)
+
 struct gif_color_table
 {
   gu16 num_colors;
   gu8 *colors;
 };
 
-struct gif_code
-{
-  gu16 len;
-  gu16 prefix_code;
-  gu8 inuse;
-  gu8 index;
-  gu8 first_index;
-};
-
 struct gif_frame
 {
   gu8 flags;
@@ -70,8 +65,25 @@ struct gif_image
   struct gif_color_table lct;
   struct gif_frame frame;
   gu8 *indices;
+  gusize data_offset;
 };
 
+/*
+ * Allocation hooks with the semantics of malloc, realloc and free, all
+ * three must be set. user is passed back as is. The hooks must be thread
+ * safe: the parallel decoders and the player call them from several
+ * threads at once, and a context may be shared between threads.
+ */
+struct gif_allocator
+{
+  void *(*alloc) (void *user, gusize size);
+  void *(*resize) (void *user, void *ptr, gusize size);
+  void (*release) (void *user, void *ptr);
+  void *user;
+};
+
+struct gif_context;
+
 struct gif
 {
   gu8 version;
@@ -82,13 +94,389 @@ struct gif
   struct gif_color_table gct;
   gu32 num_images, images_cap;
   struct gif_image *images;
+  const gu8 *src;
+  gusize src_size;
+  gi32 loop_count;
+  const struct gif_allocator *allocator;
+  struct gif_context *context;
+};
+
+/*
+ * What gif_probe finds out without decoding. duration is the sum of the
+ * frame delays in hundredths of a second. loop_count, here and in struct
+ * gif, comes from a NETSCAPE2.0 extension: -1 without one, 0 for looping
+ * forever.
+ */
+struct gif_info
+{
+  gu8 version;
+  gu16 width;
+  gu16 height;
+  gu8 flags;
+  gu8 bg_index;
+  gu16 gct_colors;
+  gu32 num_images;
+  gu32 num_frames;
+  gu64 duration;
+  gi32 loop_count;
+};
+
+/*
+ * allocator, which must outlive the gif, replaces malloc for everything
+ * the gif owns. A context takes precedence and hands out the memory from an
+ * arena instead.
+ *
+ * Parsing stops with GIF_ERR_LIMIT once a budget is exceeded, 0 meaning no
+ * limit. max_pixels is the sum of all image areas and is checked at each
+ * image descriptor, before anything is allocated for it. max_images counts
+ * every image descriptor, with or without a graphic control extension, so
+ * that images that are not frames cannot get around it. max_bytes counts
+ * the memory owned by the gif. max_ratio bounds the indices of an image per
+ * byte of its compressed data, and also applies to the part of an image
+ * decoded so far.
+ */
+struct gif_parse_options
+{
+  gu32 flags;
+  const struct gif_allocator *allocator;
+  struct gif_context *context;
+  gu64 max_pixels;
+  gu64 max_bytes;
+  gu32 max_images;
+  gu32 max_ratio;
+};
+
+/*
+ * Pixel formats, byte formats are named in memory order. RGB565 is a
+ * native-endian 16-bit word with red in the top bits. Formats without alpha
+ * show the transparent index in its palette color.
+ */
+#define GIF_FORMAT_RGBA8888 0
+#define GIF_FORMAT_BGRA8888 1
+#define GIF_FORMAT_RGB888   2
+#define GIF_FORMAT_RGB565   3
+
+/*
+ * A palette resolved to one pixel format. The transparent index keeps its
+ * color with alpha 0, indices past the palette are transparent black.
+ */
+struct gif_lut
+{
+  int format;
+  gu32 colors[256];
+};
+
+/*
+ * A rectangle of pixels on the logical screen, empty when width or height
+ * is 0.
+ */
+struct gif_rect
+{
+  gu16 x, y, width, height;
+};
+
+#define GIF_COMPOSITOR_NO_FRAME 0xFFFFFFFF
+
+/*
+ * When each frame is shown. start holds num_frames + 1 entries, frame i
+ * being shown from start[i] to start[i + 1] in hundredths of a second.
+ * base[i] is the latest frame up to i that can be drawn onto a plain
+ * background: frame 0, one after a frame that clears the whole canvas, or an
+ * opaque one covering it.
+ */
+struct gif_timeline
+{
+  gu32 num_frames;
+  gu64 *start;
+  gu32 *base;
+  const struct gif_allocator *allocator;
+};
+
+/*
+ * Plays back the images of a gif onto a canvas of gif->width by
+ * gif->height pixels, 4 bytes each in R, G, B, A order. Advancing by one
+ * frame only touches the area of the previous and the new frame. The
+ * background is the GCT background color, or transparent without a GCT.
+ *
+ * dirty holds num_dirty rectangles, at most two, that cover every pixel the
+ * last call changed: what disposing of the previous frame touched, and the
+ * bounds of the pixels the new frame drew. Transparent pixels do not count.
+ * drawn is the bounds of the pixels drawn by the current frame.
+ */
+struct gif_compositor
+{
+  struct gif *gif;
+  gu32 frame;
+  const struct gif_allocator *allocator;
+  gu8 *canvas;
+  gu8 *saved;
+  gu8 bg[4];
+  struct gif_rect dirty[2];
+  gu32 num_dirty;
+  struct gif_rect drawn;
+  struct gif_timeline timeline;
+  gu32 key_interval;
+  gu8 **keys;
+};
+
+#define GIF_CACHE_NONE 0xFFFFFFFF
+
+struct gif_cache_entry
+{
+  gu8 *data;
+  gu32 prev, next;
+};
+
+/*
+ * Composited frames of a gif, and indices of its images, kept under a
+ * budget of bytes and evicted least recently used first. entries holds the
+ * frames followed by the images, linked from head, the most recently used,
+ * to tail. Indices only count when the cache decoded them itself.
+ */
+struct gif_cache
+{
+  struct gif_compositor comp;
+  struct gif_cache_entry *entries;
+  gu32 head, tail;
+  gusize budget;
+  gusize bytes;
+  gu64 hits;
+  gu64 misses;
+  gu64 evictions;
+};
+
+/*
+ * A file mapped read-only into memory, data is NULL for an empty file.
+ */
+struct gif_file
+{
+  const gu8 *data;
+  gusize size;
 };
 
+/*
+ * A frame handed out by a player. start is when it is due in hundredths of
+ * a second since the first frame, counting on across loops, and it is shown
+ * for delay_time.
+ */
+struct gif_player_frame
+{
+  const gu8 *canvas;
+  gu32 frame;
+  gu16 delay_time;
+  gu64 start;
+};
+
+struct gif_decoder;
+struct gif_player;
+
 int gif_parse (struct gif *gif, size_t size, const char *buf);
 void gif_free (struct gif *gif);
 
+/*
+ * With GIF_PARSE_LAZY only the block structure is scanned: images are
+ * recorded with their palette, frame info and the offset of their data,
+ * but indices stay NULL until gif_image_decode is called. buf must then
+ * outlive gif, and LZW errors are only reported by gif_image_decode.
+ *
+ * With GIF_PARSE_VALIDATE the code streams are checked as thoroughly as by
+ * a full parse, with the same result, but only the indices are counted and
+ * indices stay NULL. Combined with GIF_PARSE_LAZY, images can still be
+ * decoded afterwards.
+ */
+int gif_parse_ex (struct gif *gif, size_t size, const char *buf,
+                  const struct gif_parse_options *opts);
+int gif_image_decode (struct gif_image *image);
+
+/*
+ * Frees the indices of a lazily parsed image, to be decoded again by
+ * gif_image_decode when needed. Fails with GIF_ERR_FAULT for a gif parsed
+ * eagerly or through a context, whose indices cannot be brought back or
+ * given back.
+ */
+int gif_image_evict (struct gif_image *image);
+
+/*
+ * Walks the block structure of a complete GIF, skipping image data by its
+ * sub-block lengths, without allocating. image, if not NULL, is called for
+ * every image with its descriptor, frame info and data_offset; gif is NULL
+ * and lct.colors points into buf. LZW data is not checked.
+ */
+int gif_probe (gusize size, const char *buf, struct gif_info *info,
+               void (*image) (void *user, const struct gif_image *image),
+               void *user);
+
+/*
+ * Parses the file at path from a mapping of it instead of a copy. file
+ * stays mapped on success and must then be closed after gif_free, or
+ * earlier if the gif was not parsed lazily. Even with GIF_PARSE_LAZY the
+ * scan reads every sub-block length, at most 256 bytes apart, so it touches
+ * every page of the file; what it saves is the copy and the decoding. On
+ * error file is left closed.
+ */
+int gif_file_open (struct gif_file *file, const char *path);
+void gif_file_close (struct gif_file *file);
+int gif_parse_file (struct gif *gif, struct gif_file *file, const char *path,
+                    const struct gif_parse_options *opts);
+
+/*
+ * Writes the indices of the image to dst, rows stride bytes apart. A lazily
+ * parsed image is decoded straight into dst without allocating, as long as
+ * dst spans less than 4 GiB, and its indices stay NULL. On error dst may be
+ * partly written.
+ */
+int gif_image_decode_into (struct gif_image *image, gu8 *dst, gusize stride);
+
+/*
+ * A context for decoding gif after gif without touching the heap. Every
+ * gif parsed with it allocates from its arena, which is reused as a whole
+ * once the last of them has been freed, and finished decoders are kept for
+ * the next gif_decoder_create_ex. Safe to share between threads. Scratch
+ * buffers of the parallel and drawing functions use the allocator given
+ * here, or malloc if it is NULL.
+ */
+struct gif_context *gif_context_create (const struct gif_allocator *allocator);
+void gif_context_destroy (struct gif_context *context);
+
+/*
+ * Decodes every image that has no indices yet on num_threads threads, the
+ * calling thread included. The outcome matches decoding the images in order
+ * and stopping at the first error: the images before the failing one are
+ * decoded, the ones after it are left as they were, and its error is
+ * returned.
+ */
+int gif_decode_parallel (struct gif *gif, gu32 num_threads);
+
+/*
+ * Decodes a single image on num_threads threads by splitting its code
+ * stream at clear codes, each run between two of them being independent.
+ * Falls back to gif_image_decode when the encoder did not emit any.
+ */
+int gif_image_decode_parallel (struct gif_image *image, gu32 num_threads);
+
+/*
+ * Incremental parsing: bytes may be fed in chunks of any size as they
+ * arrive. gif->num_images only counts images that are fully decoded, so
+ * frames can be consumed while the rest of the file is still coming in.
+ * On error gif is freed and every further call returns the same error.
+ * finish reports GIF_ERR_EOF if the trailer was never seen and always
+ * destroys the decoder.
+ */
+struct gif_decoder *gif_decoder_create (struct gif *gif);
+struct gif_decoder *gif_decoder_create_ex (struct gif *gif,
+                                           const struct gif_parse_options *opts);
+int gif_decoder_feed (struct gif_decoder *decoder, size_t size,
+                      const char *buf);
+int gif_decoder_finish (struct gif_decoder *decoder);
+
 struct gif_color_table *gif_image_get_palette (struct gif_image *image);
 
+/*
+ * Hands each row of the image to row as soon as it is complete, with y
+ * being its display row: interlaced images arrive pass by pass, already
+ * de-interlaced. A lazily parsed image is decoded through a window that
+ * grows with its width rather than its area and its indices stay NULL, so
+ * together with GIF_PARSE_LAZY even the largest images need little memory.
+ * indices is only valid during the call. On error some rows may already
+ * have been delivered.
+ */
+int gif_image_decode_rows (struct gif_image *image,
+                           void (*row) (void *user, gu16 y,
+                                        const gu8 *indices),
+                           void *user);
+
+/*
+ * Draws the image onto an RGBA8888 canvas the size of the logical screen,
+ * stride bytes apart per row, leaving transparent pixels as they are. A
+ * lazily parsed image that has not been decoded goes straight from the
+ * code stream to the canvas without an index buffer, so on error part of
+ * it may have been drawn.
+ */
+int gif_image_draw (struct gif_image *image, gu8 *canvas, gusize stride);
+
+/*
+ * Also sets drawn, if not NULL, to the bounds of the pixels written on the
+ * canvas, even on error. Transparent pixels are not written.
+ */
+int gif_image_draw_ex (struct gif_image *image, gu8 *canvas, gusize stride,
+                       struct gif_rect *drawn);
+
+gusize gif_format_bpp (int format);
+
+/*
+ * transparent_index is negative when there is none. expand writes count
+ * pixels, using AVX2 or SSE2 where the CPU has them.
+ */
+void gif_lut_init (struct gif_lut *lut, const struct gif_color_table *palette,
+                   gi32 transparent_index, int format);
+void gif_lut_expand (const struct gif_lut *lut, void *dst, const gu8 *indices,
+                     gusize count);
+
+/*
+ * Writes the image in format to dst, stride bytes apart per row, decoding
+ * it first if it was parsed lazily.
+ */
+int gif_image_convert (struct gif_image *image, void *dst, gusize stride,
+                       int format);
+
+/*
+ * frame_at returns the frame shown at time, wrapping around after the last
+ * one, or frame 0 if all delays are 0.
+ */
+int gif_timeline_init (struct gif_timeline *timeline, struct gif *gif);
+gu32 gif_timeline_frame_at (const struct gif_timeline *timeline, gu64 time);
+void gif_timeline_free (struct gif_timeline *timeline);
+
+/*
+ * next draws the frame after comp->frame, starting over from an empty
+ * canvas after the last one. Lazily parsed images are drawn without
+ * keeping their indices, and a frame that fails to decode resets the
+ * compositor. seek replays from the start when moving backwards.
+ *
+ * index builds the timeline of the gif for seek_time and lets seek start
+ * over from the closest frame drawn onto a plain background instead. With a
+ * key_interval, the canvas before every key_interval-th frame is also kept
+ * the first time it is drawn, and seek starts from the closest of those.
+ */
+int gif_compositor_init (struct gif_compositor *comp, struct gif *gif);
+int gif_compositor_index (struct gif_compositor *comp, gu32 key_interval);
+void gif_compositor_reset (struct gif_compositor *comp);
+int gif_compositor_next (struct gif_compositor *comp);
+int gif_compositor_seek (struct gif_compositor *comp, gu32 frame);
+int gif_compositor_seek_time (struct gif_compositor *comp, gu64 time);
+void gif_compositor_free (struct gif_compositor *comp);
+
+/*
+ * frame hands out the canvas of a frame as drawn by a compositor, and
+ * indices the indices of an image, decoding it if it was parsed lazily.
+ * Either pointer is valid until the next call on the cache. A missing frame
+ * is drawn from the closest earlier one still cached, and one larger than
+ * the budget is handed out without being kept. set_budget evicts down to
+ * the new budget at once.
+ */
+int gif_cache_init (struct gif_cache *cache, struct gif *gif, gusize budget);
+int gif_cache_frame (struct gif_cache *cache, gu32 frame, const gu8 **canvas);
+int gif_cache_indices (struct gif_cache *cache, gu32 image,
+                       const gu8 **indices);
+void gif_cache_set_budget (struct gif_cache *cache, gusize budget);
+void gif_cache_free (struct gif_cache *cache);
+
+/*
+ * Plays the gif back on a worker thread that composites up to depth frames
+ * ahead, at least 2, into a ring of canvases, looping forever. The gif must
+ * not change while the player exists.
+ *
+ * swap hands out the next frame in order and gives the one handed out
+ * before back to the worker, whose canvas is then no longer valid. It
+ * returns 1 on success and, without wait, 0 if the next frame is not ready
+ * yet, in which case the current frame stays valid. Once the worker fails
+ * to draw a frame, its error is returned after the frames before it.
+ */
+struct gif_player *gif_player_create (struct gif *gif, gu32 depth);
+int gif_player_swap (struct gif_player *player, struct gif_player_frame *frame,
+                     int wait);
+void gif_player_destroy (struct gif_player *player);
+
 const char *gif_strerr (int gif_err);
 
 #endif
@@ -0,0 +1,761 @@
+/*
+ * Copyright (c) 2025 Zachary Lamb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gif.h"
+
+// the canvas outlives neither the gif nor its allocator, but may outlive a
+// parse through a context, so it never comes from the context's arena
+static void *
+gif_heap_alloc (const struct gif_allocator *allocator, gusize size)
+{
+  if (allocator == NULL)
+    return malloc (size);
+
+  return allocator->alloc (allocator->user, size);
+}
+
+static void
+gif_heap_release (const struct gif_allocator *allocator, void *ptr)
+{
+  if (allocator == NULL)
+    free (ptr);
+  else if (ptr != NULL)
+    allocator->release (allocator->user, ptr);
+}
+
+/*
+ * Whether the image covers the whole canvas with pixels of its own, the
+ * same test gif_image_draw makes before blending: no transparent index, and
+ * no index its code size allows that would fall past the palette.
+ */
+static int
+gif_timeline_opaque (struct gif *gif, struct gif_image *image)
+{
+  struct gif_color_table *palette = gif_image_get_palette (image);
+  gu8 code_size                   = 8;
+
+  if (image->width != gif->width || image->height != gif->height
+      || (image->frame.flags & GIF_FRAME_FLAG_TRANSPARENT) || palette == NULL)
+    return 0;
+
+  if (image->indices == NULL && gif->src != NULL
+      && image->data_offset < gif->src_size
+      && gif->src[image->data_offset] <= 8)
+    code_size = gif->src[image->data_offset];
+
+  return palette->num_colors >= (1 << code_size);
+}
+
+int
+gif_timeline_init (struct gif_timeline *timeline, struct gif *gif)
+{
+  gu32 n = gif->num_images;
+
+  memset (timeline, 0, sizeof (struct gif_timeline));
+
+  timeline->allocator  = gif->allocator;
+  timeline->num_frames = n;
+
+  timeline->start = gif_heap_alloc (gif->allocator, (n + 1) * sizeof (gu64));
+  timeline->base  = gif_heap_alloc (gif->allocator, (n + 1) * sizeof (gu32));
+  if (timeline->start == NULL || timeline->base == NULL)
+    {
+      gif_timeline_free (timeline);
+      return GIF_ERR_NOMEM;
+    }
+
+  timeline->start[0] = 0;
+  timeline->base[0]  = 0;
+
+  for (gu32 i = 0; i < n; i++)
+    {
+      struct gif_image *image = gif->images + i;
+
+      timeline->start[i + 1] = timeline->start[i] + image->frame.delay_time;
+
+      // an opaque frame hides whatever was drawn before it, unless it has to
+      // be restored afterwards, which needs the canvas it was drawn onto
+      if (i && image->frame.disposal_method != GIF_FRAME_DISPOSE_RESTORE
+          && gif_timeline_opaque (gif, image))
+        timeline->base[i] = i;
+
+      // a frame disposed to the background over the whole canvas leaves
+      // nothing behind for the next one
+      if (image->frame.disposal_method == GIF_FRAME_DISPOSE_ALL
+          && image->width == gif->width && image->height == gif->height)
+        timeline->base[i + 1] = i + 1;
+      else
+        timeline->base[i + 1] = timeline->base[i];
+    }
+
+  return GIF_SUCCESS;
+}
+
+gu32
+gif_timeline_frame_at (const struct gif_timeline *timeline, gu64 time)
+{
+  gu64 duration = timeline->start[timeline->num_frames];
+  gu32 lo = 0, hi = timeline->num_frames;
+
+  if (!duration)
+    return 0;
+
+  time %= duration;
+
+  // the last frame that starts at or before time
+  while (hi - lo > 1)
+    {
+      gu32 mid = lo + (hi - lo) / 2;
+
+      if (timeline->start[mid] <= time)
+        lo = mid;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+void
+gif_timeline_free (struct gif_timeline *timeline)
+{
+  gif_heap_release (timeline->allocator, timeline->start);
+  gif_heap_release (timeline->allocator, timeline->base);
+
+  memset (timeline, 0, sizeof (struct gif_timeline));
+}
+
+static void
+gif_compositor_fill (struct gif_compositor *comp, gu16 x, gu16 y, gu16 width,
+                     gu16 height)
+{
+  gusize stride = (gusize) comp->gif->width * 4;
+
+  for (gu16 j = 0; j < height; j++)
+    {
+      gu8 *row = comp->canvas + (y + j) * stride + (gusize) x * 4;
+
+      for (gu16 i = 0; i < width; i++)
+        memcpy (row + (gusize) i * 4, comp->bg, 4);
+    }
+}
+
+/*
+ * Copies a rectangle between the canvas and the restore buffer, which has
+ * the same layout as the canvas.
+ */
+static void
+gif_compositor_copy (struct gif_compositor *comp, gu8 *dst, const gu8 *src,
+                     const struct gif_image *image)
+{
+  gusize stride = (gusize) comp->gif->width * 4,
+         off    = image->y * stride + (gusize) image->x * 4;
+
+  for (gu16 j = 0; j < image->height; j++)
+    memcpy (dst + off + j * stride, src + off + j * stride,
+            (gusize) image->width * 4);
+}
+
+static gusize
+gif_compositor_size (const struct gif_compositor *comp)
+{
+  return (gusize) comp->gif->width * comp->gif->height * 4;
+}
+
+static gu64
+gif_rect_area (const struct gif_rect *rect)
+{
+  return (gu64) rect->width * rect->height;
+}
+
+/*
+ * Adds rect to the dirty rectangles, merging it with the first one when
+ * their bounds are no larger than both of them apart.
+ */
+static void
+gif_compositor_mark (struct gif_compositor *comp, const struct gif_rect *rect)
+{
+  struct gif_rect *first = comp->dirty;
+  struct gif_rect bounds;
+
+  if (!gif_rect_area (rect))
+    return;
+
+  if (!comp->num_dirty)
+    {
+      *first          = *rect;
+      comp->num_dirty = 1;
+      return;
+    }
+
+  bounds.x      = first->x < rect->x ? first->x : rect->x;
+  bounds.y      = first->y < rect->y ? first->y : rect->y;
+  bounds.width  = (first->x + first->width > rect->x + rect->width
+                       ? first->x + first->width
+                       : rect->x + rect->width)
+                 - bounds.x;
+  bounds.height = (first->y + first->height > rect->y + rect->height
+                       ? first->y + first->height
+                       : rect->y + rect->height)
+                  - bounds.y;
+
+  if (gif_rect_area (&bounds) <= gif_rect_area (first) + gif_rect_area (rect))
+    {
+      *first          = bounds;
+      comp->num_dirty = 1;
+    }
+  else
+    {
+      comp->dirty[1]  = *rect;
+      comp->num_dirty = 2;
+    }
+}
+
+static void
+gif_compositor_mark_all (struct gif_compositor *comp)
+{
+  comp->dirty[0].x      = 0;
+  comp->dirty[0].y      = 0;
+  comp->dirty[0].width  = comp->gif->width;
+  comp->dirty[0].height = comp->gif->height;
+  comp->num_dirty       = gif_rect_area (comp->dirty) != 0;
+}
+
+int
+gif_compositor_init (struct gif_compositor *comp, struct gif *gif)
+{
+  memset (comp, 0, sizeof (struct gif_compositor));
+
+  comp->gif       = gif;
+  comp->frame     = GIF_COMPOSITOR_NO_FRAME;
+  comp->allocator = gif->allocator;
+
+  // the background is only meaningful with a GCT, transparent otherwise
+  if (gif->flags & GIF_FLAG_GCT)
+    {
+      memcpy (comp->bg, gif->gct.colors + gif->bg_index * 3, 3);
+      comp->bg[3] = 0xFF;
+    }
+
+  comp->canvas = gif_heap_alloc (comp->allocator, gif_compositor_size (comp));
+  if (comp->canvas == NULL)
+    return GIF_ERR_NOMEM;
+
+  gif_compositor_reset (comp);
+
+  return GIF_SUCCESS;
+}
+
+int
+gif_compositor_index (struct gif_compositor *comp, gu32 key_interval)
+{
+  gu32 num_keys;
+  int err;
+
+  if (comp->timeline.start != NULL)
+    return GIF_ERR_FAULT;
+
+  if ((err = gif_timeline_init (&comp->timeline, comp->gif)))
+    return err;
+
+  if (!key_interval)
+    return GIF_SUCCESS;
+
+  num_keys   = (comp->gif->num_images + key_interval - 1) / key_interval;
+  comp->keys = gif_heap_alloc (comp->allocator, num_keys * sizeof (gu8 *));
+  if (comp->keys == NULL)
+    {
+      gif_timeline_free (&comp->timeline);
+      return GIF_ERR_NOMEM;
+    }
+
+  memset (comp->keys, 0, num_keys * sizeof (gu8 *));
+  comp->key_interval = key_interval;
+
+  return GIF_SUCCESS;
+}
+
+void
+gif_compositor_reset (struct gif_compositor *comp)
+{
+  gif_compositor_fill (comp, 0, 0, comp->gif->width, comp->gif->height);
+  gif_compositor_mark_all (comp);
+  memset (&comp->drawn, 0, sizeof (struct gif_rect));
+  comp->frame = GIF_COMPOSITOR_NO_FRAME;
+}
+
+// the restore buffer is only needed once a frame asks for it
+static int
+gif_compositor_prepare (struct gif_compositor *comp,
+                        const struct gif_image *image)
+{
+  if (image->frame.disposal_method == GIF_FRAME_DISPOSE_RESTORE
+      && comp->saved == NULL)
+    {
+      comp->saved
+          = gif_heap_alloc (comp->allocator, gif_compositor_size (comp));
+      if (comp->saved == NULL)
+        return GIF_ERR_NOMEM;
+    }
+
+  return GIF_SUCCESS;
+}
+
+/*
+ * Draws frame onto the canvas it starts from, the previous frame having
+ * been disposed, taking a snapshot first if it is a keyframe that has none
+ * yet. Snapshots are only a shortcut for seeking, so failing to allocate
+ * one is not an error.
+ */
+static int
+gif_compositor_enter (struct gif_compositor *comp, gu32 frame)
+{
+  struct gif *gif         = comp->gif;
+  struct gif_image *image = gif->images + frame;
+  int err;
+
+  // a frame drawn onto the background needs no snapshot to start from
+  if (comp->key_interval && frame % comp->key_interval == 0
+      && comp->timeline.base[frame] != frame)
+    {
+      gu8 **key = comp->keys + frame / comp->key_interval;
+
+      if (*key == NULL
+          && (*key = gif_heap_alloc (comp->allocator,
+                                     gif_compositor_size (comp)))
+                 != NULL)
+        memcpy (*key, comp->canvas, gif_compositor_size (comp));
+    }
+
+  if (image->frame.disposal_method == GIF_FRAME_DISPOSE_RESTORE)
+    gif_compositor_copy (comp, comp->saved, comp->canvas, image);
+
+  // a lazily parsed frame is decoded while it is drawn, so a broken one
+  // leaves the canvas half drawn and playback starts over
+  if ((err = gif_image_draw_ex (image, comp->canvas, (gusize) gif->width * 4,
+                                &comp->drawn)))
+    {
+      gif_compositor_reset (comp);
+      return err;
+    }
+
+  gif_compositor_mark (comp, &comp->drawn);
+  comp->frame = frame;
+
+  return GIF_SUCCESS;
+}
+
+int
+gif_compositor_next (struct gif_compositor *comp)
+{
+  struct gif *gif = comp->gif;
+  gu32 next       = comp->frame + 1;
+  int err;
+
+  if (!gif->num_images)
+    return GIF_ERR_FAULT;
+
+  // wraps around at the end, NO_FRAME + 1 is frame 0 as well
+  if (next == gif->num_images)
+    next = 0;
+
+  if ((err = gif_compositor_prepare (comp, gif->images + next)))
+    return err;
+
+  comp->num_dirty = 0;
+
+  if (next == 0)
+    {
+      if (comp->frame != GIF_COMPOSITOR_NO_FRAME)
+        gif_compositor_reset (comp);
+    }
+  else
+    {
+      struct gif_image *prev = gif->images + comp->frame;
+      struct gif_rect area
+          = { prev->x, prev->y, prev->width, prev->height };
+
+      // restoring only brings back what the previous frame drew over
+      switch (prev->frame.disposal_method)
+        {
+        case GIF_FRAME_DISPOSE_ALL:
+          gif_compositor_fill (comp, prev->x, prev->y, prev->width,
+                               prev->height);
+          gif_compositor_mark (comp, &area);
+          break;
+        case GIF_FRAME_DISPOSE_RESTORE:
+          gif_compositor_copy (comp, comp->canvas, comp->saved, prev);
+          gif_compositor_mark (comp, &comp->drawn);
+          break;
+        }
+    }
+
+  return gif_compositor_enter (comp, next);
+}
+
+/*
+ * Without an index, playback restarts from frame 0 when moving backwards.
+ * With one, it restarts from the closest frame before the target that
+ * starts from a known canvas: either the background, or a snapshot.
+ */
+int
+gif_compositor_seek (struct gif_compositor *comp, gu32 frame)
+{
+  gu32 start = 0, steps = 0;
+  gu8 *key   = NULL;
+  gu8 restart = 0;
+  int err;
+
+  if (frame >= comp->gif->num_images)
+    return GIF_ERR_FAULT;
+
+  if (comp->timeline.start != NULL)
+    start = comp->timeline.base[frame];
+
+  for (gu32 k = comp->key_interval ? frame / comp->key_interval : 0;
+       comp->key_interval && k * comp->key_interval > start; k--)
+    if (comp->keys[k] != NULL)
+      {
+        start = k * comp->key_interval;
+        key   = comp->keys[k];
+        break;
+      }
+
+  // playing on is cheaper when the current frame is closer
+  if (comp->frame == GIF_COMPOSITOR_NO_FRAME || comp->frame > frame
+      || comp->frame < start)
+    {
+      if ((err = gif_compositor_prepare (comp, comp->gif->images + start)))
+        return err;
+
+      if (key != NULL)
+        memcpy (comp->canvas, key, gif_compositor_size (comp));
+      else
+        gif_compositor_fill (comp, 0, 0, comp->gif->width, comp->gif->height);
+
+      if ((err = gif_compositor_enter (comp, start)))
+        return err;
+
+      restart = 1;
+    }
+
+  for (; comp->frame != frame; steps++)
+    if ((err = gif_compositor_next (comp)))
+      return err;
+
+  // the changes of a single step are known, those of several are not merged
+  if (restart || steps > 1)
+    gif_compositor_mark_all (comp);
+  else if (!steps)
+    comp->num_dirty = 0;
+
+  return GIF_SUCCESS;
+}
+
+int
+gif_compositor_seek_time (struct gif_compositor *comp, gu64 time)
+{
+  if (comp->timeline.start == NULL)
+    return GIF_ERR_FAULT;
+
+  return gif_compositor_seek (
+      comp, gif_timeline_frame_at (&comp->timeline, time));
+}
+
+void
+gif_compositor_free (struct gif_compositor *comp)
+{
+  gif_heap_release (comp->allocator, comp->canvas);
+  gif_heap_release (comp->allocator, comp->saved);
+
+  if (comp->keys != NULL)
+    {
+      gu32 num_keys = (comp->gif->num_images + comp->key_interval - 1)
+                      / comp->key_interval;
+
+      for (gu32 k = 0; k < num_keys; k++)
+        gif_heap_release (comp->allocator, comp->keys[k]);
+
+      gif_heap_release (comp->allocator, comp->keys);
+    }
+
+  gif_timeline_free (&comp->timeline);
+
+  memset (comp, 0, sizeof (struct gif_compositor));
+}
+
+static gusize
+gif_cache_entry_size (const struct gif_cache *cache, gu32 i)
+{
+  const struct gif *gif = cache->comp.gif;
+
+  if (i < gif->num_images)
+    return gif_compositor_size (&cache->comp);
+
+  i -= gif->num_images;
+
+  return (gusize) gif->images[i].width * gif->images[i].height;
+}
+
+static void
+gif_cache_unlink (struct gif_cache *cache, gu32 i)
+{
+  struct gif_cache_entry *entry = cache->entries + i;
+
+  if (entry->prev != GIF_CACHE_NONE)
+    cache->entries[entry->prev].next = entry->next;
+  else
+    cache->head = entry->next;
+
+  if (entry->next != GIF_CACHE_NONE)
+    cache->entries[entry->next].prev = entry->prev;
+  else
+    cache->tail = entry->prev;
+
+  entry->prev = entry->next = GIF_CACHE_NONE;
+}
+
+static void
+gif_cache_push (struct gif_cache *cache, gu32 i)
+{
+  struct gif_cache_entry *entry = cache->entries + i;
+
+  entry->prev = GIF_CACHE_NONE;
+  entry->next = cache->head;
+
+  if (cache->head != GIF_CACHE_NONE)
+    cache->entries[cache->head].prev = i;
+  else
+    cache->tail = i;
+
+  cache->head = i;
+}
+
+// indices only have an entry once the cache knows it can evict them
+static void
+gif_cache_drop (struct gif_cache *cache, gu32 i)
+{
+  struct gif *gif = cache->comp.gif;
+
+  gif_cache_unlink (cache, i);
+
+  if (i < gif->num_images)
+    gif_heap_release (cache->comp.allocator, cache->entries[i].data);
+  else
+    gif_image_evict (gif->images + (i - gif->num_images));
+
+  cache->entries[i].data = NULL;
+  cache->bytes -= gif_cache_entry_size (cache, i);
+}
+
+// evicts until room more bytes fit into the budget, or nothing is left
+static void
+gif_cache_shrink (struct gif_cache *cache, gusize room)
+{
+  while (cache->tail != GIF_CACHE_NONE
+         && (cache->bytes + room > cache->budget || room > cache->budget))
+    {
+      gif_cache_drop (cache, cache->tail);
+      ++cache->evictions;
+    }
+}
+
+int
+gif_cache_init (struct gif_cache *cache, struct gif *gif, gusize budget)
+{
+  gu32 num_entries = gif->num_images * 2;
+  int err;
+
+  memset (cache, 0, sizeof (struct gif_cache));
+
+  if ((err = gif_compositor_init (&cache->comp, gif)))
+    return err;
+
+  if ((err = gif_compositor_index (&cache->comp, 0)))
+    {
+      gif_compositor_free (&cache->comp);
+      return err;
+    }
+
+  cache->entries = gif_heap_alloc (cache->comp.allocator,
+                                   num_entries * sizeof (struct gif_cache_entry));
+  if (cache->entries == NULL && num_entries)
+    {
+      gif_compositor_free (&cache->comp);
+      return GIF_ERR_NOMEM;
+    }
+
+  for (gu32 i = 0; i < num_entries; i++)
+    {
+      cache->entries[i].data = NULL;
+      cache->entries[i].prev = cache->entries[i].next = GIF_CACHE_NONE;
+    }
+
+  cache->head = cache->tail = GIF_CACHE_NONE;
+  cache->budget             = budget;
+
+  return GIF_SUCCESS;
+}
+
+/*
+ * The compositor only keeps the last frame it drew, so a missing frame is
+ * drawn from that or from a cached frame between it and its base frame,
+ * whichever is closer. A cached frame that restores the canvas when
+ * disposed cannot be started from, the compositor lacking what it covered.
+ */
+int
+gif_cache_frame (struct gif_cache *cache, gu32 frame, const gu8 **canvas)
+{
+  struct gif_compositor *comp = &cache->comp;
+  struct gif *gif             = comp->gif;
+  struct gif_cache_entry *entry;
+  gusize size = gif_compositor_size (comp);
+  int err;
+
+  if (frame >= gif->num_images)
+    return GIF_ERR_FAULT;
+
+  gif_cache_shrink (cache, 0);
+
+  entry = cache->entries + frame;
+
+  if (entry->data != NULL)
+    {
+      ++cache->hits;
+      gif_cache_unlink (cache, frame);
+      gif_cache_push (cache, frame);
+      *canvas = entry->data;
+      return GIF_SUCCESS;
+    }
+
+  ++cache->misses;
+
+  for (gu32 f = frame; f-- > comp->timeline.base[frame];)
+    {
+      if (comp->frame == f)
+        break;
+
+      if (cache->entries[f].data != NULL
+          && gif->images[f].frame.disposal_method != GIF_FRAME_DISPOSE_RESTORE)
+        {
+          memcpy (comp->canvas, cache->entries[f].data, size);
+          comp->frame = f;
+          break;
+        }
+    }
+
+  if ((err = gif_compositor_seek (comp, frame)))
+    return err;
+
+  *canvas = comp->canvas;
+
+  if (size > cache->budget)
+    return GIF_SUCCESS;
+
+  gif_cache_shrink (cache, size);
+
+  // keeping the frame is only an optimization
+  if ((entry->data = gif_heap_alloc (comp->allocator, size)) == NULL)
+    return GIF_SUCCESS;
+
+  memcpy (entry->data, comp->canvas, size);
+  cache->bytes += size;
+  gif_cache_push (cache, frame);
+  *canvas = entry->data;
+
+  return GIF_SUCCESS;
+}
+
+/*
+ * Indices that were there before the cache are handed out as they are, and
+ * so are those of a gif whose images cannot be evicted. Indices larger than
+ * the budget are kept until the next call.
+ */
+int
+gif_cache_indices (struct gif_cache *cache, gu32 image, const gu8 **indices)
+{
+  struct gif *gif = cache->comp.gif;
+  struct gif_image *img;
+  gu32 i = gif->num_images + image;
+  int err;
+
+  if (image >= gif->num_images)
+    return GIF_ERR_FAULT;
+
+  gif_cache_shrink (cache, 0);
+
+  img = gif->images + image;
+
+  if (cache->entries[i].data != NULL)
+    {
+      ++cache->hits;
+      gif_cache_unlink (cache, i);
+      gif_cache_push (cache, i);
+      *indices = cache->entries[i].data;
+      return GIF_SUCCESS;
+    }
+
+  if (img->indices == NULL)
+    {
+      ++cache->misses;
+
+      if (gif->src != NULL && gif->context == NULL)
+        gif_cache_shrink (cache, gif_cache_entry_size (cache, i));
+
+      if ((err = gif_image_decode (img)))
+        return err;
+
+      if (gif->src != NULL && gif->context == NULL)
+        {
+          cache->entries[i].data = img->indices;
+          cache->bytes += gif_cache_entry_size (cache, i);
+          gif_cache_push (cache, i);
+        }
+    }
+
+  *indices = img->indices;
+
+  return GIF_SUCCESS;
+}
+
+void
+gif_cache_set_budget (struct gif_cache *cache, gusize budget)
+{
+  cache->budget = budget;
+  gif_cache_shrink (cache, 0);
+}
+
+void
+gif_cache_free (struct gif_cache *cache)
+{
+  while (cache->head != GIF_CACHE_NONE)
+    gif_cache_drop (cache, cache->head);
+
+  gif_heap_release (cache->comp.allocator, cache->entries);
+  gif_compositor_free (&cache->comp);
+
+  memset (cache, 0, sizeof (struct gif_cache));
+}
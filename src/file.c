@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2025 Zachary Lamb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "gif.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+int
+gif_file_open (struct gif_file *file, const char *path)
+{
+  HANDLE handle, mapping;
+  LARGE_INTEGER size;
+  void *data = NULL;
+
+  file->data = NULL;
+  file->size = 0;
+
+  handle = CreateFileA (path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (handle == INVALID_HANDLE_VALUE)
+    return GIF_ERR_IO;
+
+  if (!GetFileSizeEx (handle, &size) || (gu64) size.QuadPart > (gusize) -1)
+    {
+      CloseHandle (handle);
+      return GIF_ERR_IO;
+    }
+
+  // an empty file cannot be mapped, it parses as truncated all the same
+  if (size.QuadPart == 0)
+    {
+      CloseHandle (handle);
+      return GIF_SUCCESS;
+    }
+
+  mapping = CreateFileMappingA (handle, NULL, PAGE_READONLY, 0, 0, NULL);
+
+  // the view keeps the file open
+  if (mapping != NULL)
+    {
+      data = MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle (mapping);
+    }
+
+  CloseHandle (handle);
+
+  if (data == NULL)
+    return GIF_ERR_IO;
+
+  file->data = data;
+  file->size = (gusize) size.QuadPart;
+
+  return GIF_SUCCESS;
+}
+
+void
+gif_file_close (struct gif_file *file)
+{
+  if (file->data != NULL)
+    UnmapViewOfFile (file->data);
+
+  file->data = NULL;
+  file->size = 0;
+}
+
+#else
+
+int
+gif_file_open (struct gif_file *file, const char *path)
+{
+  struct stat st;
+  void *data;
+  int fd;
+
+  file->data = NULL;
+  file->size = 0;
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return GIF_ERR_IO;
+
+  if (fstat (fd, &st) || !S_ISREG (st.st_mode)
+      || (gu64) st.st_size > (gusize) -1)
+    {
+      close (fd);
+      return GIF_ERR_IO;
+    }
+
+  // an empty file cannot be mapped, it parses as truncated all the same
+  if (st.st_size == 0)
+    {
+      close (fd);
+      return GIF_SUCCESS;
+    }
+
+  // the mapping keeps the file open
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+
+  if (data == MAP_FAILED)
+    return GIF_ERR_IO;
+
+  file->data = data;
+  file->size = st.st_size;
+
+  return GIF_SUCCESS;
+}
+
+void
+gif_file_close (struct gif_file *file)
+{
+  if (file->data != NULL)
+    munmap ((void *) file->data, file->size);
+
+  file->data = NULL;
+  file->size = 0;
+}
+
+#endif
+
+int
+gif_parse_file (struct gif *gif, struct gif_file *file, const char *path,
+                const struct gif_parse_options *opts)
+{
+  int err;
+
+  if ((err = gif_file_open (file, path)))
+    return err;
+
+  if ((err = gif_parse_ex (gif, file->size, (const char *) file->data, opts)))
+    gif_file_close (file);
+
+  return err;
+}
@@ -20,597 +20,3066 @@
  * IN THE SOFTWARE.
  */
 
-#include <stdio.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "gif.h"
 
-struct vec
+#define GIF_LZW_MORE 0
+#define GIF_LZW_END  1
+
+#define GIF_LZW_MAX_CODES 4096
+
+/*
+ * Every code in the table refers back to the first place its string was
+ * written to the output, so expanding a code is a single copy from earlier
+ * output rather than a walk of its prefix chain.
+ *
+ * Interlaced images are written in display order, and rows may be further
+ * apart than the width: output offsets in the table are where the indices
+ * ended up, and a string is only copied in one go if it lies within a row
+ * both there and where it goes. Strings that do not, about one per row, are
+ * copied index by index through the mapping from decode order to output
+ * offsets.
+ *
+ * Only codes from first_next_code up to next_code have an entry, so a clear
+ * code just resets next_code. The offset and length of an entry are read
+ * together and kept in two dense arrays, 24 KiB in all.
+ */
+struct gif_lzw
+{
+  gu64 bits;
+  gu8 num_bits;
+  gu8 min_code_size;
+  gu8 code_size;
+  gu8 first_code;
+  gu16 num_colors;
+  gu16 max_color;
+  gu16 first_next_code;
+  gu16 next_code;
+  gu32 prev_len;
+  gu32 prev_offset;
+  gu32 prev_row_left;
+  gu8 interlaced;
+  gu8 split;
+  gu16 width;
+  gu32 stride;
+  gu32 pass_end[3];
+  gu32 offset[GIF_LZW_MAX_CODES];
+  gu16 len[GIF_LZW_MAX_CODES];
+};
+
+/*
+ * Flags in the top bits of len for strings that have to be copied through
+ * the row mapping, or that end too close to the end of a row to be read as
+ * a word. Table strings are never longer than the table.
+ */
+#define GIF_LZW_LEN   0x3FFF
+#define GIF_LZW_SPLIT 0x4000
+#define GIF_LZW_EDGE  0x8000
+
+static inline gu64
+gif_load_u64_le (const gu8 *p)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  gu64 w;
+  memcpy (&w, p, sizeof (w));
+  return w;
+#else
+  return (gu64) p[0] | (gu64) p[1] << 8 | (gu64) p[2] << 16
+         | (gu64) p[3] << 24 | (gu64) p[4] << 32 | (gu64) p[5] << 40
+         | (gu64) p[6] << 48 | (gu64) p[7] << 56;
+#endif
+}
+
+static inline gu16
+gif_load_u16_le (const gu8 *p)
+{
+  return (gu16) (p[0] | p[1] << 8);
+}
+
+/*
+ * Tops up the bit accumulator. A single unaligned load covers at least four
+ * codes, only the last few bytes of the input are read bytewise.
+ */
+#define GIF_LZW_REFILL(BITS, NUM_BITS, BUF, SIZE)                             \
+  do                                                                          \
+    {                                                                         \
+      if ((SIZE) >= 8)                                                        \
+        {                                                                     \
+          gusize n_ = (63 - (NUM_BITS)) >> 3;                                 \
+          (BITS) |= gif_load_u64_le (BUF) << (NUM_BITS);                      \
+          (BUF) += n_;                                                        \
+          (SIZE) -= n_;                                                       \
+          (NUM_BITS) += n_ << 3;                                              \
+        }                                                                     \
+      else                                                                    \
+        while ((SIZE) && (NUM_BITS) <= 56)                                    \
+          {                                                                   \
+            (BITS) |= (gu64) * (BUF)++ << (NUM_BITS);                         \
+            (NUM_BITS) += 8;                                                  \
+            --(SIZE);                                                         \
+          }                                                                   \
+    }                                                                         \
+  while (0)
+
+/*
+ * Copies a string from earlier output. Short strings are moved as one 8
+ * byte word when room, which must hold for both ends, allows: the source is
+ * read past its end and the excess bytes are overwritten by the strings
+ * that follow.
+ */
+static inline void
+gif_lzw_copy (gu8 *dst, const gu8 *src, gu32 len, gu32 room)
+{
+  if (len <= 8 && room >= 8)
+    {
+      gu64 w;
+      memcpy (&w, src, sizeof (w));
+      memcpy (dst, &w, sizeof (w));
+    }
+  else
+    memcpy (dst, src, len);
+}
+
+static void
+gif_lzw_init (struct gif_lzw *lzw, const struct gif_image *image,
+              gu32 stride, gu8 min_code_size, gu16 num_colors)
+{
+  gu32 height = image->height;
+
+  lzw->bits            = 0;
+  lzw->num_bits        = 0;
+  lzw->min_code_size   = min_code_size;
+  lzw->code_size       = min_code_size + 1;
+  lzw->first_code      = 1;
+  lzw->first_next_code = (1 << min_code_size) + 2;
+  lzw->next_code       = lzw->first_next_code;
+  lzw->prev_len        = 0;
+  lzw->prev_offset     = 0;
+  lzw->prev_row_left   = 0;
+  lzw->interlaced      = (image->flags & GIF_IMAGE_FLAG_INTERLACED) != 0;
+  lzw->width           = image->width;
+  lzw->stride          = stride;
+  lzw->split           = lzw->interlaced || stride != image->width;
+
+  // decode order rows where the passes of 8, 8, 4 and 2 rows end
+  lzw->pass_end[0] = (height + 7) / 8;
+  lzw->pass_end[1] = lzw->pass_end[0] + (height + 3) / 8;
+  lzw->pass_end[2] = lzw->pass_end[1] + (height + 1) / 4;
+
+  if (num_colors > (1 << min_code_size))
+    num_colors = 1 << min_code_size;
+
+  lzw->num_colors = num_colors;
+  lzw->max_color  = num_colors;
+
+  // NOTE: non-standard convention that indices that fall in gap
+  // between colors and clear code are transparent
+  // we map num_colors + 1 to a transparent color if a gap exists
+  if (num_colors < (1 << min_code_size))
+    ++lzw->max_color;
+}
+
+// output offset of the i-th index in decode order
+static gu32
+gif_lzw_map (const struct gif_lzw *lzw, gu32 i)
+{
+  gu32 r, y;
+
+  if (!lzw->split)
+    return i;
+
+  r = i / lzw->width;
+
+  if (!lzw->interlaced)
+    y = r;
+  else if (r < lzw->pass_end[0])
+    y = r * 8;
+  else if (r < lzw->pass_end[1])
+    y = (r - lzw->pass_end[0]) * 8 + 4;
+  else if (r < lzw->pass_end[2])
+    y = (r - lzw->pass_end[1]) * 4 + 2;
+  else
+    y = (r - lzw->pass_end[2]) * 2 + 1;
+
+  return y * lzw->stride + i % lzw->width;
+}
+
+static gu32
+gif_lzw_unmap (const struct gif_lzw *lzw, gu32 offset)
+{
+  gu32 y, r;
+
+  if (!lzw->split)
+    return offset;
+
+  y = offset / lzw->stride;
+
+  if (!lzw->interlaced)
+    r = y;
+  else if (y % 8 == 0)
+    r = y / 8;
+  else if (y % 8 == 4)
+    r = lzw->pass_end[0] + y / 8;
+  else if (y % 4 == 2)
+    r = lzw->pass_end[1] + y / 4;
+  else
+    r = lzw->pass_end[2] + y / 2;
+
+  return r * lzw->width + offset % lzw->stride;
+}
+
+/*
+ * Finds where the i-th index goes and how many indices can be written
+ * there in one go.
+ */
+static inline void
+gif_lzw_locate (const struct gif_lzw *lzw, gu32 i, gu32 max_out, gu32 *dst,
+                gu32 *row_left)
+{
+  gu32 left = max_out - i;
+
+  if (lzw->split)
+    {
+      *dst      = gif_lzw_map (lzw, i);
+      *row_left = lzw->width - i % lzw->width;
+
+      if (*row_left > left)
+        *row_left = left;
+    }
+  else
+    {
+      *dst      = i;
+      *row_left = left;
+    }
+}
+
+/*
+ * The slow path for strings that cross a row on either side, dst and src
+ * are in decode order. The source ends at or before dst, so the pieces
+ * never overlap.
+ */
+static void
+gif_lzw_copy_rows (const struct gif_lzw *lzw, gu8 *out, gu32 dst, gu32 src,
+                   gu32 len)
+{
+  while (len)
+    {
+      gu32 n = len;
+
+      if (lzw->split)
+        {
+          gu32 dst_left = lzw->width - dst % lzw->width,
+               src_left = lzw->width - src % lzw->width;
+
+          n = dst_left < src_left ? dst_left : src_left;
+
+          if (n > len)
+            n = len;
+        }
+
+      memcpy (out + gif_lzw_map (lzw, dst), out + gif_lzw_map (lzw, src), n);
+
+      dst += n;
+      src += n;
+      len -= n;
+    }
+}
+
+#if defined(__GNUC__)
+#define GIF_ALWAYS_INLINE inline __attribute__ ((always_inline))
+#else
+#define GIF_ALWAYS_INLINE inline
+#endif
+
+/*
+ * Decodes the code stream contained in one data sub-block. The bit
+ * accumulator is carried over in lzw between calls so that codes may
+ * straddle sub-block boundaries. out must hold the whole image, since codes
+ * are expanded by copying from earlier output. Returns GIF_LZW_END once the
+ * EOI code is seen or the image is full, GIF_LZW_MORE if more data is
+ * required, or a GIF error code.
+ *
+ * min_code_size is passed apart from lzw so that it can be a constant, see
+ * gif_lzw_decode.
+ */
+static GIF_ALWAYS_INLINE int
+gif_lzw_decode_kernel (struct gif_lzw *lzw, const gu8 *buf, gusize size,
+                       gu8 *restrict out, gu32 *num_out, gu32 max_out,
+                       const gu8 min_code_size)
+{
+  gu32 *restrict table_offset = lzw->offset;
+  gu16 *restrict table_len     = lzw->len;
+
+  gu64 bits          = lzw->bits;
+  gu32 num_bits      = lzw->num_bits;
+  gu32 code_size     = lzw->code_size;
+  gu32 code_mask     = (1 << code_size) - 1;
+  gu32 num_indices   = *num_out;
+  gu32 prev_offset   = lzw->prev_offset, prev_len = lzw->prev_len;
+  gu32 prev_row_left = lzw->prev_row_left;
+  gu32 dst, row_left;
+  gu16 next_code = lzw->next_code;
+  gu8 first_code = lzw->first_code;
+
+  const gu16 clear_code = 1 << min_code_size, eoi_code = clear_code + 1,
+             num_colors      = lzw->num_colors,
+             max_color       = lzw->max_color,
+             first_next_code = clear_code + 2;
+  int result = GIF_LZW_MORE;
+
+  gif_lzw_locate (lzw, num_indices, max_out, &dst, &row_left);
+
+  for (;;)
+    {
+      gu16 code;
+
+      if (num_bits < code_size)
+        {
+          GIF_LZW_REFILL (bits, num_bits, buf, size);
+
+          if (num_bits < code_size)
+            break;
+        }
+
+      code = bits & code_mask;
+      bits >>= code_size;
+      num_bits -= code_size;
+
+      if (code == clear_code)
+        {
+          first_code = 1;
+          code_size  = min_code_size + 1;
+          code_mask  = (1 << code_size) - 1;
+          next_code  = first_next_code;
+          continue;
+        }
+
+      if (code == eoi_code)
+        {
+          result = GIF_LZW_END;
+          break;
+        }
+
+      if (first_code)
+        {
+          if (code >= num_colors)
+            {
+              if (code >= first_next_code)
+                return GIF_ERR_BAD_DATA;
+
+              // if in gap, normalize to transparent index
+              code = num_colors;
+            }
+
+          if (num_indices >= max_out)
+            {
+              result = GIF_LZW_END;
+              break;
+            }
+
+          prev_offset   = dst;
+          prev_len      = 1;
+          prev_row_left = row_left;
+
+          out[dst] = code;
+          ++num_indices;
+
+          if (row_left > 1)
+            {
+              ++dst;
+              --row_left;
+            }
+          else
+            gif_lzw_locate (lzw, num_indices, max_out, &dst, &row_left);
+
+          first_code = 0;
+          continue;
+        }
+
+      gu32 room = max_out - num_indices;
+      gu32 len;
+
+      // a code has at most 12 bits and table entries only ever point at
+      // output that has been written, so these checks can only catch bugs
+#ifdef LIBGIF_SLOW
+      if (code > 4095)
+        return GIF_ERR_FAULT;
+#endif
+
+      if ((gu16) (code - first_next_code)
+          < (gu16) (next_code - first_next_code))
+        {
+          gu32 offset = table_offset[code];
+          gu16 flags  = table_len[code] & ~GIF_LZW_LEN;
+
+          len = table_len[code] & GIF_LZW_LEN;
+
+          if (len > room)
+            {
+              result = GIF_LZW_END;
+              break;
+            }
+
+#ifdef LIBGIF_SLOW
+          if (gif_lzw_unmap (lzw, offset) + len > num_indices)
+            return GIF_ERR_FAULT;
+#endif
+
+          if (len <= row_left && !(flags & GIF_LZW_SPLIT))
+            gif_lzw_copy (out + dst, out + offset, len,
+                          flags & GIF_LZW_EDGE ? 0 : row_left);
+          else
+            gif_lzw_copy_rows (lzw, out, num_indices,
+                               gif_lzw_unmap (lzw, offset), len);
+        }
+      else if (code < max_color)
+        {
+          len = 1;
+
+          if (!room)
+            {
+              result = GIF_LZW_END;
+              break;
+            }
+
+          out[dst] = code;
+        }
+      else
+        {
+          // code not yet in the table: the previous string followed by its
+          // own first index
+          len = prev_len + 1;
+
+          if (len > room)
+            {
+              result = GIF_LZW_END;
+              break;
+            }
+
+#ifdef LIBGIF_SLOW
+          if (gif_lzw_unmap (lzw, prev_offset) + prev_len > num_indices)
+            return GIF_ERR_FAULT;
+#endif
+
+          if (len <= row_left && prev_len <= prev_row_left)
+            {
+              gif_lzw_copy (out + dst, out + prev_offset, prev_len,
+                            row_left < prev_row_left ? row_left
+                                                     : prev_row_left);
+              out[dst + prev_len] = out[prev_offset];
+            }
+          else
+            {
+              gif_lzw_copy_rows (lzw, out, num_indices,
+                                 gif_lzw_unmap (lzw, prev_offset), prev_len);
+              out[gif_lzw_map (lzw, num_indices + prev_len)]
+                  = out[prev_offset];
+            }
+        }
+
+      // the new entry is the previous string followed by the first index
+      // of this one, which is exactly where the previous string was written
+      if (next_code < GIF_LZW_MAX_CODES)
+        {
+          table_offset[next_code] = prev_offset;
+          table_len[next_code]    = (prev_len + 1)
+                                 | (prev_len >= prev_row_left ? GIF_LZW_SPLIT
+                                    : prev_row_left < 8       ? GIF_LZW_EDGE
+                                                              : 0);
+          ++next_code;
+
+          if (next_code == (1 << code_size) && next_code != GIF_LZW_MAX_CODES)
+            {
+              ++code_size;
+              code_mask = (1 << code_size) - 1;
+            }
+        }
+
+      prev_offset   = dst;
+      prev_len      = len;
+      prev_row_left = row_left;
+      num_indices += len;
+
+      if (len < row_left)
+        {
+          dst += len;
+          row_left -= len;
+        }
+      else
+        gif_lzw_locate (lzw, num_indices, max_out, &dst, &row_left);
+    }
+
+  lzw->bits          = bits;
+  lzw->num_bits      = num_bits;
+  lzw->code_size     = code_size;
+  lzw->first_code    = first_code;
+  lzw->next_code     = next_code;
+  lzw->prev_len      = prev_len;
+  lzw->prev_offset   = prev_offset;
+  lzw->prev_row_left = prev_row_left;
+
+  *num_out = num_indices;
+
+  return result;
+}
+
+/*
+ * 8-bit images, by far the most common, get a copy of the decode loop in
+ * which the clear code, EOI code and first free code are constants.
+ */
+static int
+gif_lzw_decode (struct gif_lzw *lzw, const gu8 *buf, gusize size,
+                gu8 *restrict out, gu32 *num_out, gu32 max_out)
+{
+  if (lzw->min_code_size == 8)
+    return gif_lzw_decode_kernel (lzw, buf, size, out, num_out, max_out, 8);
+
+  return gif_lzw_decode_kernel (lzw, buf, size, out, num_out, max_out,
+                                lzw->min_code_size);
+}
+
+/*
+ * gif_lzw without any output, for checking a code stream: whether an image
+ * is accepted only depends on the length of each string, so that is all
+ * the table keeps.
+ */
+struct gif_lzw_count
+{
+  gu64 bits;
+  gu8 num_bits;
+  gu8 min_code_size;
+  gu8 code_size;
+  gu8 first_code;
+  gu16 max_color;
+  gu16 first_next_code;
+  gu16 next_code;
+  gu32 prev_len;
+  gu16 len[GIF_LZW_MAX_CODES];
+};
+
+static void
+gif_lzw_count_init (struct gif_lzw_count *lzw, gu8 min_code_size,
+                    gu16 num_colors)
+{
+  gu16 clear_code = 1 << min_code_size;
+
+  lzw->bits            = 0;
+  lzw->num_bits        = 0;
+  lzw->min_code_size   = min_code_size;
+  lzw->code_size       = min_code_size + 1;
+  lzw->first_code      = 1;
+  lzw->first_next_code = clear_code + 2;
+  lzw->next_code       = lzw->first_next_code;
+  lzw->prev_len        = 0;
+
+  if (num_colors > clear_code)
+    num_colors = clear_code;
+
+  // see gif_lzw_init, first codes past the colors are only checked
+  // against the table size
+  lzw->max_color = num_colors < clear_code ? num_colors + 1 : num_colors;
+}
+
+/*
+ * gif_lzw_decode counting the indices it would write, with the same
+ * results for the same code stream.
+ */
+static int
+gif_lzw_count (struct gif_lzw_count *lzw, const gu8 *buf, gusize size,
+               gu32 *num_out, gu32 max_out)
+{
+  gu64 bits        = lzw->bits;
+  gu32 num_bits    = lzw->num_bits;
+  gu32 code_size   = lzw->code_size;
+  gu32 code_mask   = (1 << code_size) - 1;
+  gu32 num_indices = *num_out;
+  gu32 prev_len    = lzw->prev_len;
+  gu16 next_code   = lzw->next_code;
+  gu8 first_code   = lzw->first_code;
+
+  const gu16 clear_code = 1 << lzw->min_code_size,
+             eoi_code        = clear_code + 1, max_color = lzw->max_color,
+             first_next_code = lzw->first_next_code;
+  int result = GIF_LZW_MORE;
+
+  for (;;)
+    {
+      gu32 len;
+      gu16 code;
+
+      if (num_bits < code_size)
+        {
+          GIF_LZW_REFILL (bits, num_bits, buf, size);
+
+          if (num_bits < code_size)
+            break;
+        }
+
+      code = bits & code_mask;
+      bits >>= code_size;
+      num_bits -= code_size;
+
+      if (code == clear_code)
+        {
+          first_code = 1;
+          code_size  = lzw->min_code_size + 1;
+          code_mask  = (1 << code_size) - 1;
+          next_code  = first_next_code;
+          continue;
+        }
+
+      if (code == eoi_code)
+        {
+          result = GIF_LZW_END;
+          break;
+        }
+
+      if (first_code)
+        {
+          if (code >= first_next_code)
+            return GIF_ERR_BAD_DATA;
+
+          if (num_indices >= max_out)
+            {
+              result = GIF_LZW_END;
+              break;
+            }
+
+          prev_len = 1;
+          ++num_indices;
+
+          first_code = 0;
+          continue;
+        }
+
+      if ((gu16) (code - first_next_code)
+          < (gu16) (next_code - first_next_code))
+        len = lzw->len[code];
+      else if (code < max_color)
+        len = 1;
+      else
+        len = prev_len + 1;
+
+      if (len > max_out - num_indices)
+        {
+          result = GIF_LZW_END;
+          break;
+        }
+
+      if (next_code < GIF_LZW_MAX_CODES)
+        {
+          lzw->len[next_code++] = prev_len + 1;
+
+          if (next_code == (1 << code_size) && next_code != GIF_LZW_MAX_CODES)
+            {
+              ++code_size;
+              code_mask = (1 << code_size) - 1;
+            }
+        }
+
+      prev_len = len;
+      num_indices += len;
+    }
+
+  lzw->bits       = bits;
+  lzw->num_bits   = num_bits;
+  lzw->code_size  = code_size;
+  lzw->first_code = first_code;
+  lzw->next_code  = next_code;
+  lzw->prev_len   = prev_len;
+
+  *num_out = num_indices;
+
+  return result;
+}
+
+/*
+ * Output for decoding without the whole image in memory. Rows are handed to
+ * emit with their display row as soon as they are complete, but buf keeps a
+ * window of recent output so that most codes can still be expanded by
+ * copying, as in gif_lzw_decode. Offsets are into the whole output: buf[0]
+ * is at base and done is where the next row to be emitted starts.
+ */
+struct gif_rows
+{
+  void (*emit) (void *ctx, gu16 y, const gu8 *indices);
+  void *ctx;
+  gu8 *buf;
+  gu32 cap;
+  gu32 base;
+  gu32 fill;
+  gu32 done;
+  gu32 max_indices;
+  gu32 y;
+  gu16 width;
+  gu16 height;
+  gu8 pass;
+  gu8 interlaced;
+};
+
+#define GIF_ROWS_WINDOW (1 << 17)
+
+static const gu8 gif_interlace_start[] = { 0, 4, 2, 1 };
+static const gu8 gif_interlace_step[]  = { 8, 8, 4, 2 };
+
+/*
+ * The window slides by half, which must leave room for a partial row and
+ * the longest table string. A small image fits whole and never slides.
+ */
+static gu32
+gif_rows_size (gu16 width, gu16 height)
+{
+  gu32 whole = (gu32) width * height + GIF_LZW_MAX_CODES + 8,
+       size  = 2 * ((gu32) width + GIF_LZW_MAX_CODES + 8);
+
+  if (size < GIF_ROWS_WINDOW)
+    size = GIF_ROWS_WINDOW;
+
+  return size < whole ? size : whole;
+}
+
+static void
+gif_rows_init (struct gif_rows *rows, gu8 *buf, gu16 width, gu16 height,
+               gu8 interlaced)
+{
+  rows->buf         = buf;
+  rows->cap         = gif_rows_size (width, height);
+  rows->base        = 0;
+  rows->fill        = 0;
+  rows->done        = 0;
+  rows->max_indices = (gu32) width * height;
+  rows->y           = 0;
+  rows->width       = width;
+  rows->height      = height;
+  rows->pass        = 0;
+  rows->interlaced  = interlaced;
+}
+
+static void
+gif_rows_flush (struct gif_rows *rows)
+{
+  gu32 end = rows->base + rows->fill;
+
+  while (end - rows->done >= rows->width)
+    {
+      rows->emit (rows->ctx, rows->y, rows->buf + (rows->done - rows->base));
+      rows->done += rows->width;
+
+      if (!rows->interlaced)
+        ++rows->y;
+      else
+        {
+          // rows of each pass are spread over the image, passes that
+          // start below the last row are empty
+          rows->y += gif_interlace_step[rows->pass];
+
+          while (rows->y >= rows->height && rows->pass < 3)
+            rows->y = gif_interlace_start[++rows->pass];
+        }
+    }
+}
+
+static void
+gif_rows_slide (struct gif_rows *rows)
+{
+  gu32 d = rows->fill - rows->cap / 2;
+
+  memmove (rows->buf, rows->buf + d, rows->fill - d);
+  rows->base += d;
+  rows->fill -= d;
+}
+
+static void
+gif_rows_repeat (struct gif_rows *rows, gu8 index, gu32 n)
+{
+  while (n)
+    {
+      gu32 k;
+
+      if (rows->fill == rows->cap)
+        gif_rows_slide (rows);
+
+      k = rows->cap - rows->fill;
+      if (k > n)
+        k = n;
+
+      memset (rows->buf + rows->fill, index, k);
+      rows->fill += k;
+      n -= k;
+
+      gif_rows_flush (rows);
+    }
+}
+
+/*
+ * The code table of gif_lzw kept in prefix chain form as well, for codes
+ * whose first occurrence has left the window: their string is written back
+ * to front by following the prefixes down to a single index.
+ *
+ * Once the table is full, codes that are not in it keep extending the
+ * previous string by its first index; prev_extra counts those indices so
+ * the string need not be in the table.
+ */
+struct gif_lzw_chain
+{
+  gu64 bits;
+  gu8 num_bits;
+  gu8 min_code_size;
+  gu8 code_size;
+  gu8 first_code;
+  gu16 num_colors;
+  gu16 max_color;
+  gu16 first_next_code;
+  gu16 next_code;
+  gu16 prev_code;
+  gu32 prev_extra;
+  gu32 prev_offset;
+  gu32 offset[GIF_LZW_MAX_CODES];
+  gu16 prefix[GIF_LZW_MAX_CODES];
+  gu16 len[GIF_LZW_MAX_CODES];
+  gu8 suffix[GIF_LZW_MAX_CODES];
+};
+
+static void
+gif_lzw_chain_init (struct gif_lzw_chain *lzw, gu8 min_code_size,
+                    gu16 num_colors)
+{
+  gu16 clear_code = 1 << min_code_size;
+
+  lzw->bits            = 0;
+  lzw->num_bits        = 0;
+  lzw->min_code_size   = min_code_size;
+  lzw->code_size       = min_code_size + 1;
+  lzw->first_code      = 1;
+  lzw->first_next_code = clear_code + 2;
+  lzw->next_code       = lzw->first_next_code;
+  lzw->prev_code       = 0;
+  lzw->prev_extra      = 0;
+  lzw->prev_offset     = 0;
+
+  if (num_colors > clear_code)
+    num_colors = clear_code;
+
+  // see gif_lzw_init
+  lzw->num_colors = num_colors;
+  lzw->max_color  = num_colors < clear_code ? num_colors + 1 : num_colors;
+
+  for (gu16 i = 0; i < clear_code; i++)
+    lzw->len[i] = 1;
+}
+
+/*
+ * Writes the string of code to the rows, followed by extra copies of its
+ * first index, and returns that first index.
+ */
+static inline gu8
+gif_lzw_chain_put (const struct gif_lzw_chain *lzw, struct gif_rows *rows,
+                   gu16 code, gu32 extra)
+{
+  gu16 len = lzw->len[code];
+  gu32 offset = lzw->offset[code];
+  gu8 *p, first;
+
+  if (rows->fill + len > rows->cap)
+    gif_rows_slide (rows);
+
+  p = rows->buf + rows->fill;
+
+  if (code < lzw->first_next_code)
+    *p = code;
+  else if (offset >= rows->base)
+    gif_lzw_copy (p, rows->buf + (offset - rows->base), len,
+                  rows->cap - rows->fill);
+  else
+    {
+      gu8 *q = p + len - 1;
+
+      while (code >= lzw->first_next_code)
+        {
+          *q-- = lzw->suffix[code];
+          code = lzw->prefix[code];
+        }
+
+      *q = code;
+    }
+
+  first = *p;
+
+  rows->fill += len;
+
+  if (rows->base + rows->fill - rows->done >= rows->width)
+    gif_rows_flush (rows);
+
+  if (extra)
+    gif_rows_repeat (rows, first, extra);
+
+  return first;
+}
+
+/*
+ * gif_lzw_decode writing to rows: the same code stream yields the same
+ * indices, but only a window of them is kept.
+ */
+static int
+gif_lzw_chain_decode (struct gif_lzw_chain *lzw, const gu8 *buf, gusize size,
+                      struct gif_rows *rows)
+{
+  gu64 bits        = lzw->bits;
+  gu32 num_bits    = lzw->num_bits;
+  gu32 code_size   = lzw->code_size;
+  gu32 code_mask   = (1 << code_size) - 1;
+  gu32 prev_extra  = lzw->prev_extra;
+  gu32 prev_offset = lzw->prev_offset;
+  gu16 next_code = lzw->next_code, prev_code = lzw->prev_code;
+  gu8 first_code = lzw->first_code;
+
+  const gu16 clear_code = 1 << lzw->min_code_size,
+             eoi_code = clear_code + 1, num_colors = lzw->num_colors,
+             max_color = lzw->max_color,
+             first_next_code = lzw->first_next_code;
+
+  int result = GIF_LZW_MORE;
+
+  for (;;)
+    {
+      gu32 offset = rows->base + rows->fill,
+           room   = rows->max_indices - offset, len;
+      gu16 code;
+      gu8 first;
+
+      if (num_bits < code_size)
+        {
+          GIF_LZW_REFILL (bits, num_bits, buf, size);
+
+          if (num_bits < code_size)
+            break;
+        }
+
+      code = bits & code_mask;
+      bits >>= code_size;
+      num_bits -= code_size;
+
+      if (code == clear_code)
+        {
+          first_code = 1;
+          code_size  = lzw->min_code_size + 1;
+          code_mask  = (1 << code_size) - 1;
+          next_code  = first_next_code;
+          continue;
+        }
+
+      if (code == eoi_code)
+        {
+          result = GIF_LZW_END;
+          break;
+        }
+
+      if (first_code)
+        {
+          if (code >= num_colors)
+            {
+              if (code >= first_next_code)
+                return GIF_ERR_BAD_DATA;
+
+              code = num_colors;
+            }
+
+          if (!room)
+            {
+              result = GIF_LZW_END;
+              break;
+            }
+
+          gif_lzw_chain_put (lzw, rows, code, 0);
+
+          prev_code   = code;
+          prev_extra  = 0;
+          prev_offset = offset;
+          first_code  = 0;
+          continue;
+        }
+
+      if (code < max_color || (code >= first_next_code && code < next_code))
+        {
+          len = lzw->len[code];
+
+          if (len > room)
+            {
+              result = GIF_LZW_END;
+              break;
+            }
+
+          first = gif_lzw_chain_put (lzw, rows, code, 0);
+        }
+      else
+        {
+          len = lzw->len[prev_code] + prev_extra + 1;
+
+          if (len > room)
+            {
+              result = GIF_LZW_END;
+              break;
+            }
+
+          first = gif_lzw_chain_put (lzw, rows, prev_code, prev_extra + 1);
+          code  = next_code;
+        }
+
+      if (next_code < GIF_LZW_MAX_CODES)
+        {
+          lzw->offset[next_code] = prev_offset;
+          lzw->prefix[next_code] = prev_code;
+          lzw->suffix[next_code] = first;
+          lzw->len[next_code]    = lzw->len[prev_code] + 1;
+          ++next_code;
+
+          if (next_code == (1 << code_size) && next_code != GIF_LZW_MAX_CODES)
+            {
+              ++code_size;
+              code_mask = (1 << code_size) - 1;
+            }
+
+          prev_extra = 0;
+        }
+      else if (code == next_code)
+        {
+          // the string is only in the table up to its first index
+          ++prev_extra;
+          continue;
+        }
+
+      prev_code   = code;
+      prev_extra  = 0;
+      prev_offset = offset;
+    }
+
+  lzw->bits        = bits;
+  lzw->num_bits    = num_bits;
+  lzw->code_size   = code_size;
+  lzw->first_code  = first_code;
+  lzw->next_code   = next_code;
+  lzw->prev_code   = prev_code;
+  lzw->prev_extra  = prev_extra;
+  lzw->prev_offset = prev_offset;
+
+  return result;
+}
+
+static void *
+gif_std_alloc (void *user, gusize size)
+{
+  (void) user;
+  return malloc (size);
+}
+
+static void *
+gif_std_resize (void *user, void *ptr, gusize size)
+{
+  (void) user;
+  return realloc (ptr, size);
+}
+
+static void
+gif_std_release (void *user, void *ptr)
+{
+  (void) user;
+  free (ptr);
+}
+
+static const struct gif_allocator gif_std_allocator
+    = { gif_std_alloc, gif_std_resize, gif_std_release, NULL };
+
+#define GIF_ARENA_ALIGN     16
+#define GIF_ARENA_MIN_CHUNK (1 << 16)
+
+/*
+ * Arena chunks are used newest first. Nothing is released until the last
+ * gif using the context is freed, at which point the chunks are merged
+ * into one as big as all of them, so the next parse of a similar file
+ * allocates nothing.
+ */
+struct gif_arena_chunk
+{
+  struct gif_arena_chunk *next;
+  gusize size;
+  gusize used;
+};
+
+#define GIF_ARENA_HEADER                                                      \
+  ((sizeof (struct gif_arena_chunk) + GIF_ARENA_ALIGN - 1)                    \
+   & ~(gusize) (GIF_ARENA_ALIGN - 1))
+
+struct gif_context
+{
+  struct gif_allocator allocator;
+  pthread_mutex_t lock;
+  struct gif_arena_chunk *chunks;
+  gusize total;
+  gu32 users;
+  void *last;
+  struct gif_decoder *decoder;
+};
+
+struct gif_context *
+gif_context_create (const struct gif_allocator *allocator)
+{
+  struct gif_context *context;
+
+  if (allocator == NULL)
+    allocator = &gif_std_allocator;
+
+  context = allocator->alloc (allocator->user, sizeof (struct gif_context));
+  if (context == NULL)
+    return NULL;
+
+  memset (context, 0, sizeof (struct gif_context));
+  context->allocator = *allocator;
+
+  if (pthread_mutex_init (&context->lock, NULL))
+    {
+      allocator->release (allocator->user, context);
+      return NULL;
+    }
+
+  return context;
+}
+
+static void
+gif_arena_drop (struct gif_context *context)
+{
+  struct gif_arena_chunk *chunk = context->chunks, *next;
+
+  for (; chunk != NULL; chunk = next)
+    {
+      next = chunk->next;
+      context->allocator.release (context->allocator.user, chunk);
+    }
+
+  context->chunks = NULL;
+  context->total  = 0;
+  context->last   = NULL;
+}
+
+void
+gif_context_destroy (struct gif_context *context)
+{
+  if (context == NULL)
+    return;
+
+  gif_arena_drop (context);
+
+  if (context->decoder != NULL)
+    context->allocator.release (context->allocator.user, context->decoder);
+
+  pthread_mutex_destroy (&context->lock);
+  context->allocator.release (context->allocator.user, context);
+}
+
+static void *
+gif_arena_alloc (struct gif_context *context, gusize size)
+{
+  struct gif_arena_chunk *chunk;
+  void *p = NULL;
+
+  size = (size + GIF_ARENA_ALIGN - 1) & ~(gusize) (GIF_ARENA_ALIGN - 1);
+
+  pthread_mutex_lock (&context->lock);
+
+  chunk = context->chunks;
+
+  if (chunk == NULL || chunk->size - chunk->used < size)
+    {
+      gusize csize = context->total > GIF_ARENA_MIN_CHUNK
+                         ? context->total
+                         : GIF_ARENA_MIN_CHUNK;
+
+      if (csize < size)
+        csize = size;
+
+      chunk = context->allocator.alloc (context->allocator.user,
+                                        GIF_ARENA_HEADER + csize);
+
+      if (chunk != NULL)
+        {
+          chunk->next     = context->chunks;
+          chunk->size     = csize;
+          chunk->used     = 0;
+          context->chunks = chunk;
+          context->total += csize;
+        }
+    }
+
+  if (chunk != NULL)
+    {
+      p = (gu8 *) chunk + GIF_ARENA_HEADER + chunk->used;
+      chunk->used += size;
+      context->last = p;
+    }
+
+  pthread_mutex_unlock (&context->lock);
+
+  return p;
+}
+
+// grows the latest allocation in place when it has room to
+static void *
+gif_arena_resize (struct gif_context *context, void *ptr, gusize old_size,
+                  gusize size)
+{
+  struct gif_arena_chunk *chunk;
+  void *p;
+
+  pthread_mutex_lock (&context->lock);
+
+  chunk = context->chunks;
+
+  if (ptr != NULL && ptr == context->last)
+    {
+      gusize start = (gu8 *) ptr - ((gu8 *) chunk + GIF_ARENA_HEADER);
+
+      size = (size + GIF_ARENA_ALIGN - 1) & ~(gusize) (GIF_ARENA_ALIGN - 1);
+
+      if (chunk->size - start >= size)
+        {
+          chunk->used = start + size;
+          pthread_mutex_unlock (&context->lock);
+          return ptr;
+        }
+    }
+
+  pthread_mutex_unlock (&context->lock);
+
+  if ((p = gif_arena_alloc (context, size)) != NULL && ptr != NULL)
+    memcpy (p, ptr, old_size);
+
+  return p;
+}
+
+static void
+gif_context_acquire (struct gif_context *context)
+{
+  pthread_mutex_lock (&context->lock);
+  ++context->users;
+  pthread_mutex_unlock (&context->lock);
+}
+
+static void
+gif_context_release (struct gif_context *context)
+{
+  pthread_mutex_lock (&context->lock);
+
+  if (!--context->users && context->chunks != NULL)
+    {
+      gusize total = context->total;
+
+      if (context->chunks->next != NULL)
+        {
+          gif_arena_drop (context);
+
+          context->chunks = context->allocator.alloc (
+              context->allocator.user, GIF_ARENA_HEADER + total);
+
+          if (context->chunks != NULL)
+            {
+              context->chunks->next = NULL;
+              context->chunks->size = total;
+              context->total        = total;
+            }
+        }
+
+      if (context->chunks != NULL)
+        context->chunks->used = 0;
+
+      context->last = NULL;
+    }
+
+  pthread_mutex_unlock (&context->lock);
+}
+
+/*
+ * Memory owned by a gif comes from its context if it has one, and from its
+ * allocator otherwise. Scratch memory that does not outlive a call always
+ * comes from the allocator, so that repeated calls do not grow the arena.
+ */
+static const struct gif_allocator *
+gif_allocator (const struct gif *gif)
+{
+  return gif->allocator != NULL ? gif->allocator : &gif_std_allocator;
+}
+
+static void *
+gif_mem_alloc (struct gif *gif, gusize size)
+{
+  const struct gif_allocator *allocator = gif_allocator (gif);
+
+  if (gif->context != NULL)
+    return gif_arena_alloc (gif->context, size);
+
+  return allocator->alloc (allocator->user, size);
+}
+
+static void *
+gif_mem_resize (struct gif *gif, void *ptr, gusize old_size, gusize size)
+{
+  const struct gif_allocator *allocator = gif_allocator (gif);
+
+  if (gif->context != NULL)
+    return gif_arena_resize (gif->context, ptr, old_size, size);
+
+  return allocator->resize (allocator->user, ptr, size);
+}
+
+static void
+gif_mem_release (struct gif *gif, void *ptr)
+{
+  const struct gif_allocator *allocator = gif_allocator (gif);
+
+  if (gif->context == NULL && ptr != NULL)
+    allocator->release (allocator->user, ptr);
+}
+
+#define GIF_STATE_HEADER          0
+#define GIF_STATE_GCT             1
+#define GIF_STATE_BLOCK           2
+#define GIF_STATE_IMAGE           3
+#define GIF_STATE_LCT             4
+#define GIF_STATE_IMAGE_DATA_INIT 5
+#define GIF_STATE_IMAGE_DATA_LEN  6
+#define GIF_STATE_IMAGE_DATA      7
+#define GIF_STATE_EXT             8
+#define GIF_STATE_GCE             9
+#define GIF_STATE_EXT_DATA_LEN    10
+#define GIF_STATE_EXT_DATA        11
+#define GIF_STATE_APP             12
+#define GIF_STATE_LOOP            13
+#define GIF_STATE_DONE            14
+
+/*
+ * Everything gif_parse used to keep in locals, so that parsing can stop at
+ * any byte and resume once more data arrives. The image currently being
+ * decoded is owned by the decoder until it is complete, at which point it
+ * is appended to gif->images.
+ */
+struct gif_decoder
+{
+  struct gif *gif;
+  const struct gif_allocator *allocator;
+  struct gif_context *context;
+  int state;
+  int error;
+  gu32 flags;
+
+  // stream offset of the next byte to be fed
+  gusize pos;
+
+  // partial fixed-size units (header, descriptors) that span feeds
+  gu8 hold[16];
+  gu8 held;
+
+  gu8 sub_len;
+  gu16 table_fill;
+
+  gu8 is_frame;
+  gu8 is_loop;
+  gu16 num_colors;
+  struct gif_frame frame;
+
+  struct gif_image img;
+  gu32 num_indices, req_indices;
+  gu64 data_bytes;
+  int lzw_result;
+
+  // budgets from gif_parse_options and what has been used of them
+  gu64 max_pixels, max_bytes;
+  gu32 max_images, max_ratio;
+  gu64 pixels, bytes;
+  struct gif_lzw lzw;
+  struct gif_lzw_count count;
+};
+
+/*
+ * Returns a pointer to the next need bytes of input, either in place or
+ * gathered in decoder->hold across feeds, or NULL if the input ran out
+ * first.
+ */
+static const gu8 *
+gif_decoder_take (struct gif_decoder *decoder, const gu8 **buf, gusize *size,
+                  gu8 need)
+{
+  const gu8 *unit;
+  gusize n;
+
+  if (!decoder->held && *size >= need)
+    {
+      unit = *buf;
+      *buf += need;
+      *size -= need;
+      return unit;
+    }
+
+  n = need - decoder->held;
+  if (n > *size)
+    n = *size;
+
+  memcpy (decoder->hold + decoder->held, *buf, n);
+  decoder->held += n;
+  *buf += n;
+  *size -= n;
+
+  if (decoder->held < need)
+    return NULL;
+
+  decoder->held = 0;
+  return decoder->hold;
+}
+
+/*
+ * Copies color table bytes into table until it is full, returns whether it
+ * is.
+ */
+static int
+gif_decoder_fill_table (struct gif_decoder *decoder,
+                        struct gif_color_table *table, const gu8 **buf,
+                        gusize *size)
+{
+  gusize num_bytes = table->num_colors * 3, n = num_bytes - decoder->table_fill;
+
+  if (n > *size)
+    n = *size;
+
+  memcpy (table->colors + decoder->table_fill, *buf, n);
+  decoder->table_fill += n;
+  *buf += n;
+  *size -= n;
+
+  if (decoder->table_fill < num_bytes)
+    return 0;
+
+  decoder->table_fill = 0;
+  return 1;
+}
+
+static void
+gif_decoder_drop_image (struct gif_decoder *decoder)
+{
+  if (decoder->img.flags & GIF_IMAGE_FLAG_LCT)
+    gif_mem_release (decoder->gif, decoder->img.lct.colors);
+
+  gif_mem_release (decoder->gif, decoder->img.indices);
+  memset (&decoder->img, 0, sizeof (struct gif_image));
+}
+
+static void
+gif_decoder_init (struct gif_decoder *decoder, struct gif *gif,
+                  const struct gif_parse_options *opts)
+{
+  memset (gif, 0, sizeof (struct gif));
+
+  decoder->gif        = gif;
+  decoder->state      = GIF_STATE_HEADER;
+  decoder->error      = GIF_SUCCESS;
+  decoder->flags      = opts ? opts->flags : 0;
+  decoder->pos        = 0;
+  decoder->held       = 0;
+  decoder->sub_len    = 0;
+  decoder->table_fill = 0;
+  decoder->is_frame   = 0;
+  decoder->is_loop    = 0;
+  decoder->max_pixels = opts ? opts->max_pixels : 0;
+  decoder->max_bytes  = opts ? opts->max_bytes : 0;
+  decoder->max_images = opts ? opts->max_images : 0;
+  decoder->max_ratio  = opts ? opts->max_ratio : 0;
+  decoder->pixels     = 0;
+  decoder->bytes      = 0;
+
+  memset (&decoder->img, 0, sizeof (struct gif_image));
+
+  gif->loop_count = -1;
+
+  if (opts != NULL && opts->context != NULL)
+    {
+      gif->context   = opts->context;
+      gif->allocator = &opts->context->allocator;
+      gif_context_acquire (gif->context);
+    }
+  else if (opts != NULL)
+    gif->allocator = opts->allocator;
+}
+
+// returns the version of a GIF signature, or a negative value
+static int
+gif_read_version (const gu8 *unit)
+{
+  if (unit[0] != 0x47 || unit[1] != 0x49 || unit[2] != 0x46 || unit[3] != 0x38
+      || unit[5] != 0x61)
+    return -1;
+
+  switch (unit[4])
+    {
+    case 0x37:
+      return GIF_VERSION_87A;
+    case 0x39:
+      return GIF_VERSION_89A;
+    default:
+      return -1;
+    }
+}
+
+// accounts for size more bytes owned by the gif before they are allocated
+static int
+gif_decoder_charge (struct gif_decoder *decoder, gusize size)
+{
+  decoder->bytes += size;
+
+  if (decoder->max_bytes && decoder->bytes > decoder->max_bytes)
+    return GIF_ERR_LIMIT;
+
+  return GIF_SUCCESS;
+}
+
+static int
+gif_decoder_header (struct gif_decoder *decoder, const gu8 *unit)
+{
+  struct gif *gif = decoder->gif;
+  int version     = gif_read_version (unit), err;
+
+  if (version < 0)
+    return GIF_ERR_BAD_DATA;
+
+  gif->version = version;
+
+  gif->width  = gif_load_u16_le (unit + 6);
+  gif->height = gif_load_u16_le (unit + 8);
+
+  gu8 packed_byte = unit[0xA];
+  gif->bg_index   = unit[0xB]; // NOTE: meaningless if GCT not present
+
+  if (!(packed_byte & 0x80))
+    {
+      decoder->state = GIF_STATE_BLOCK;
+      return GIF_SUCCESS;
+    }
+
+  gif->flags |= GIF_FLAG_GCT;
+  gif->gct.num_colors = 1 << ((packed_byte & 0x7) + 1);
+
+  if (gif->bg_index >= gif->gct.num_colors)
+    return GIF_ERR_BAD_DATA;
+
+  if ((err = gif_decoder_charge (decoder, gif->gct.num_colors * 3)))
+    return err;
+
+  gif->gct.colors = gif_mem_alloc (gif, gif->gct.num_colors * 3);
+  if (gif->gct.colors == NULL)
+    return GIF_ERR_NOMEM;
+
+  decoder->state = GIF_STATE_GCT;
+
+  return GIF_SUCCESS;
+}
+
+static int
+gif_decoder_image (struct gif_decoder *decoder, const gu8 *unit)
+{
+  struct gif *gif       = decoder->gif;
+  struct gif_image *img = &decoder->img;
+  int err;
+
+  img->gif    = gif;
+  img->x      = gif_load_u16_le (unit + 0);
+  img->y      = gif_load_u16_le (unit + 2);
+  img->width  = gif_load_u16_le (unit + 4);
+  img->height = gif_load_u16_le (unit + 6);
+
+  if (!img->width || !img->height
+      || (gu32) img->x + (gu32) img->width > (gu32) gif->width
+      || (gu32) img->y + (gu32) img->height > (gu32) gif->height)
+    return GIF_ERR_BAD_DATA;
+
+  // checked before anything is allocated for the image
+  decoder->pixels += (gu32) img->width * img->height;
+
+  if ((decoder->max_images && gif->num_images >= decoder->max_images)
+      || (decoder->max_pixels && decoder->pixels > decoder->max_pixels))
+    return GIF_ERR_LIMIT;
+
+  gu8 packed_byte = unit[8];
+
+  if (packed_byte & 0x40)
+    img->flags |= GIF_IMAGE_FLAG_INTERLACED;
+
+  if (decoder->is_frame)
+    {
+      decoder->is_frame = 0;
+      img->flags |= GIF_IMAGE_FLAG_FRAME;
+      img->frame = decoder->frame;
+    }
+
+  if (packed_byte & 0x80)
+    {
+      img->flags |= GIF_IMAGE_FLAG_LCT;
+
+      img->lct.num_colors = 1 << ((packed_byte & 0x7) + 1);
+      decoder->num_colors = img->lct.num_colors;
+
+      if ((err = gif_decoder_charge (decoder, img->lct.num_colors * 3)))
+        return err;
+
+      img->lct.colors
+          = gif_mem_alloc (decoder->gif, img->lct.num_colors * 3);
+      if (img->lct.colors == NULL)
+        return GIF_ERR_NOMEM;
+
+      decoder->state = GIF_STATE_LCT;
+    }
+  else if (!(gif->flags & GIF_FLAG_GCT))
+    return GIF_ERR_BAD_DATA;
+  else
+    {
+      decoder->num_colors = gif->gct.num_colors;
+      decoder->state      = GIF_STATE_IMAGE_DATA_INIT;
+    }
+
+  return GIF_SUCCESS;
+}
+
+static int
+gif_decoder_image_data (struct gif_decoder *decoder, const gu8 *unit)
+{
+  struct gif_image *img = &decoder->img;
+  gu8 min_lzw_code_size = unit[0];
+  int err;
+
+  decoder->sub_len     = unit[1];
+  decoder->num_indices = 0;
+  decoder->data_bytes  = 0;
+
+  if (!decoder->sub_len || (min_lzw_code_size < 2 || min_lzw_code_size > 8))
+    return GIF_ERR_BAD_DATA;
+
+  decoder->state = GIF_STATE_IMAGE_DATA;
+
+  // only remember where the data starts, gif_image_decode does the rest
+  if ((decoder->flags & GIF_PARSE_LAZY)
+      && !(decoder->flags & GIF_PARSE_VALIDATE))
+    {
+      decoder->lzw_result = GIF_LZW_END;
+      return GIF_SUCCESS;
+    }
+
+  decoder->req_indices = (gu32) img->width * img->height;
+  decoder->lzw_result  = GIF_LZW_MORE;
+
+  if (decoder->flags & GIF_PARSE_VALIDATE)
+    {
+      gif_lzw_count_init (&decoder->count, min_lzw_code_size,
+                          decoder->num_colors);
+      return GIF_SUCCESS;
+    }
+
+  if ((err = gif_decoder_charge (decoder, decoder->req_indices)))
+    return err;
+
+  img->indices = gif_mem_alloc (decoder->gif, decoder->req_indices);
+  if (img->indices == NULL)
+    return GIF_ERR_NOMEM;
+
+  gif_lzw_init (&decoder->lzw, img, img->width, min_lzw_code_size,
+                decoder->num_colors);
+
+  return GIF_SUCCESS;
+}
+
+static int
+gif_decoder_image_end (struct gif_decoder *decoder)
+{
+  struct gif *gif = decoder->gif;
+  int err;
+
+  if ((!(decoder->flags & GIF_PARSE_LAZY)
+       || (decoder->flags & GIF_PARSE_VALIDATE))
+      && decoder->num_indices != decoder->req_indices)
+    return GIF_ERR_BAD_DATA;
+
+  // a lazily parsed image is held to the ratio it will have once decoded
+  if (decoder->max_ratio
+      && (gu64) decoder->img.width * decoder->img.height
+             > decoder->max_ratio * decoder->data_bytes)
+    return GIF_ERR_LIMIT;
+
+  if (gif->num_images == gif->images_cap)
+    {
+      gusize ncap = gif->images_cap + 8;
+      struct gif_image *imgs;
+
+      if ((err = gif_decoder_charge (decoder,
+                                     8 * sizeof (struct gif_image))))
+        return err;
+
+      imgs = gif_mem_resize (
+          gif, gif->images, gif->images_cap * sizeof (struct gif_image),
+          ncap * sizeof (struct gif_image));
+
+      if (imgs == NULL)
+        return GIF_ERR_NOMEM;
+
+      gif->images_cap = ncap;
+      gif->images     = imgs;
+    }
+
+  gif->images[gif->num_images++] = decoder->img;
+  memset (&decoder->img, 0, sizeof (struct gif_image));
+
+  decoder->state = GIF_STATE_BLOCK;
+
+  return GIF_SUCCESS;
+}
+
+static int
+gif_read_gce (struct gif_frame *frame, const gu8 *unit)
+{
+  gu8 packed_byte = unit[0];
+
+  if (unit[4] != 0)
+    return GIF_ERR_BAD_DATA;
+
+  memset (frame, 0, sizeof (struct gif_frame));
+
+  frame->disposal_method = (packed_byte >> 2) & 7;
+
+  if (frame->disposal_method == 0 || frame->disposal_method > 3)
+    frame->disposal_method = GIF_FRAME_DISPOSE_NONE;
+
+  if (packed_byte & 2)
+    frame->flags |= GIF_FRAME_FLAG_USER_INPUT;
+
+  if (packed_byte & 1)
+    {
+      frame->flags |= GIF_FRAME_FLAG_TRANSPARENT;
+      frame->transparent_index = unit[3];
+    }
+
+  frame->delay_time = gif_load_u16_le (unit + 1);
+
+  return GIF_SUCCESS;
+}
+
+static int
+gif_decoder_gce (struct gif_decoder *decoder, const gu8 *unit)
+{
+  int err;
+
+  if ((err = gif_read_gce (&decoder->frame, unit)))
+    return err;
+
+  decoder->is_frame = 1;
+  decoder->state    = GIF_STATE_BLOCK;
+
+  return GIF_SUCCESS;
+}
+
+/*
+ * Whether an application extension identifier is one of the looping
+ * extensions, whose first sub-block holds 1 and the loop count.
+ */
+static int
+gif_is_loop_app (const gu8 *unit)
+{
+  return !memcmp (unit, "NETSCAPE2.0", 11) || !memcmp (unit, "ANIMEXTS1.0", 11);
+}
+
+static int
+gif_decoder_step (struct gif_decoder *decoder, const gu8 **buf, gusize *size)
+{
+  struct gif *gif = decoder->gif;
+  const gu8 *unit;
+  gusize n;
+
+  switch (decoder->state)
+    {
+    case GIF_STATE_HEADER:
+      if ((unit = gif_decoder_take (decoder, buf, size, 0xD)) == NULL)
+        return GIF_SUCCESS;
+      return gif_decoder_header (decoder, unit);
+    case GIF_STATE_GCT:
+      if (gif_decoder_fill_table (decoder, &gif->gct, buf, size))
+        decoder->state = GIF_STATE_BLOCK;
+      return GIF_SUCCESS;
+    case GIF_STATE_BLOCK:
+      switch (*(*buf)++)
+        {
+        case 0x2C: // image descriptor
+          decoder->state = GIF_STATE_IMAGE;
+          break;
+        case 0x21: // ext introducer
+          decoder->state = GIF_STATE_EXT;
+          break;
+        case 0x3B: // trailer
+          decoder->state = GIF_STATE_DONE;
+          break;
+        default: // unknown separator
+          return GIF_ERR_BAD_DATA;
+        }
+      --*size;
+      return GIF_SUCCESS;
+    case GIF_STATE_IMAGE:
+      if ((unit = gif_decoder_take (decoder, buf, size, 9)) == NULL)
+        return GIF_SUCCESS;
+      return gif_decoder_image (decoder, unit);
+    case GIF_STATE_LCT:
+      if (gif_decoder_fill_table (decoder, &decoder->img.lct, buf, size))
+        decoder->state = GIF_STATE_IMAGE_DATA_INIT;
+      return GIF_SUCCESS;
+    case GIF_STATE_IMAGE_DATA_INIT:
+      decoder->img.data_offset = decoder->pos - decoder->held;
+      if ((unit = gif_decoder_take (decoder, buf, size, 2)) == NULL)
+        return GIF_SUCCESS;
+      return gif_decoder_image_data (decoder, unit);
+    case GIF_STATE_IMAGE_DATA_LEN:
+      decoder->sub_len = *(*buf)++;
+      --*size;
+
+      if (!decoder->sub_len)
+        return gif_decoder_image_end (decoder);
+
+      decoder->state = GIF_STATE_IMAGE_DATA;
+      return GIF_SUCCESS;
+    case GIF_STATE_IMAGE_DATA:
+      n = decoder->sub_len;
+      if (n > *size)
+        n = *size;
+
+      // once the code stream has ended, the remaining sub-blocks are only
+      // skipped
+      if (decoder->lzw_result == GIF_LZW_MORE)
+        {
+          if (decoder->flags & GIF_PARSE_VALIDATE)
+            decoder->lzw_result
+                = gif_lzw_count (&decoder->count, *buf, n,
+                                 &decoder->num_indices, decoder->req_indices);
+          else
+            decoder->lzw_result = gif_lzw_decode (
+                &decoder->lzw, *buf, n, decoder->img.indices,
+                &decoder->num_indices, decoder->req_indices);
+
+          if (decoder->lzw_result < 0)
+            return decoder->lzw_result;
+        }
+
+      // the output so far is held to the ratio as well, so that a bomb is
+      // stopped early
+      decoder->data_bytes += n;
+
+      if (decoder->max_ratio
+          && decoder->num_indices > decoder->max_ratio * decoder->data_bytes)
+        return GIF_ERR_LIMIT;
+
+      *buf += n;
+      *size -= n;
+      decoder->sub_len -= n;
+
+      if (!decoder->sub_len)
+        decoder->state = GIF_STATE_IMAGE_DATA_LEN;
+      return GIF_SUCCESS;
+    case GIF_STATE_EXT:
+      if ((unit = gif_decoder_take (decoder, buf, size, 2)) == NULL)
+        return GIF_SUCCESS;
+
+      decoder->sub_len = unit[1];
+
+      if (unit[0] == 0xF9 && decoder->sub_len == 0x4)
+        decoder->state = GIF_STATE_GCE;
+      else if (unit[0] == 0xFF && decoder->sub_len == 11)
+        decoder->state = GIF_STATE_APP;
+      else if (decoder->sub_len)
+        decoder->state = GIF_STATE_EXT_DATA;
+      else
+        decoder->state = GIF_STATE_BLOCK;
+      return GIF_SUCCESS;
+    case GIF_STATE_GCE:
+      if ((unit = gif_decoder_take (decoder, buf, size, 5)) == NULL)
+        return GIF_SUCCESS;
+      return gif_decoder_gce (decoder, unit);
+    case GIF_STATE_APP:
+      if ((unit = gif_decoder_take (decoder, buf, size, 11)) == NULL)
+        return GIF_SUCCESS;
+
+      decoder->is_loop = gif_is_loop_app (unit);
+      decoder->state   = GIF_STATE_EXT_DATA_LEN;
+      return GIF_SUCCESS;
+    case GIF_STATE_LOOP:
+      if ((unit = gif_decoder_take (decoder, buf, size, 3)) == NULL)
+        return GIF_SUCCESS;
+
+      if (unit[0] == 1)
+        gif->loop_count = gif_load_u16_le (unit + 1);
+
+      decoder->state = GIF_STATE_EXT_DATA_LEN;
+      return GIF_SUCCESS;
+    case GIF_STATE_EXT_DATA_LEN:
+      decoder->sub_len = *(*buf)++;
+      --*size;
+
+      if (decoder->is_loop && decoder->sub_len == 3)
+        decoder->state = GIF_STATE_LOOP;
+      else
+        decoder->state
+            = decoder->sub_len ? GIF_STATE_EXT_DATA : GIF_STATE_BLOCK;
+
+      // only the first sub-block carries the loop count
+      decoder->is_loop = 0;
+      return GIF_SUCCESS;
+    case GIF_STATE_EXT_DATA:
+      n = decoder->sub_len;
+      if (n > *size)
+        n = *size;
+
+      *buf += n;
+      *size -= n;
+      decoder->sub_len -= n;
+
+      if (!decoder->sub_len)
+        decoder->state = GIF_STATE_EXT_DATA_LEN;
+      return GIF_SUCCESS;
+    default:
+      return GIF_ERR_FAULT;
+    }
+}
+
+static int
+gif_decoder_fail (struct gif_decoder *decoder, int err)
+{
+  gif_decoder_drop_image (decoder);
+  gif_free (decoder->gif);
+
+  decoder->error = err;
+
+  return err;
+}
+
+static int
+gif_decoder_end (struct gif_decoder *decoder)
+{
+  if (decoder->error)
+    return decoder->error;
+
+  if (decoder->state != GIF_STATE_DONE)
+    return gif_decoder_fail (decoder, GIF_ERR_EOF);
+
+  return GIF_SUCCESS;
+}
+
+struct gif_decoder *
+gif_decoder_create (struct gif *gif)
+{
+  return gif_decoder_create_ex (gif, NULL);
+}
+
+struct gif_decoder *
+gif_decoder_create_ex (struct gif *gif, const struct gif_parse_options *opts)
+{
+  struct gif_context *context = opts ? opts->context : NULL;
+  const struct gif_allocator *allocator = &gif_std_allocator;
+  struct gif_decoder *decoder = NULL;
+
+  // a context keeps the last finished decoder for the next one
+  if (context != NULL)
+    {
+      pthread_mutex_lock (&context->lock);
+      decoder          = context->decoder;
+      context->decoder = NULL;
+      pthread_mutex_unlock (&context->lock);
+
+      allocator = &context->allocator;
+    }
+  else if (opts != NULL && opts->allocator != NULL)
+    allocator = opts->allocator;
+
+  if (decoder == NULL)
+    decoder = allocator->alloc (allocator->user, sizeof (struct gif_decoder));
+
+  if (decoder == NULL)
+    return NULL;
+
+  gif_decoder_init (decoder, gif, opts);
+  decoder->allocator = allocator;
+  decoder->context   = context;
+
+  return decoder;
+}
+
+int
+gif_decoder_feed (struct gif_decoder *decoder, gusize size, const char *buf)
+{
+  const gu8 *p = (const gu8 *) buf;
+  int err;
+
+  if (decoder->error)
+    return decoder->error;
+
+  // anything past the trailer is ignored
+  while (size && decoder->state != GIF_STATE_DONE)
+    {
+      gusize left = size;
+
+      if ((err = gif_decoder_step (decoder, &p, &size)))
+        return gif_decoder_fail (decoder, err);
+
+      decoder->pos += left - size;
+    }
+
+  return GIF_SUCCESS;
+}
+
+int
+gif_decoder_finish (struct gif_decoder *decoder)
+{
+  struct gif_context *context = decoder->context;
+  int err = gif_decoder_end (decoder);
+
+  if (context != NULL)
+    {
+      pthread_mutex_lock (&context->lock);
+
+      if (context->decoder == NULL)
+        {
+          context->decoder = decoder;
+          decoder          = NULL;
+        }
+
+      pthread_mutex_unlock (&context->lock);
+    }
+
+  if (decoder != NULL)
+    decoder->allocator->release (decoder->allocator->user, decoder);
+
+  return err;
+}
+
+int
+gif_parse (struct gif *gif, gusize size, const char *buf)
+{
+  return gif_parse_ex (gif, size, buf, NULL);
+}
+
+int
+gif_parse_ex (struct gif *gif, gusize size, const char *buf,
+              const struct gif_parse_options *opts)
+{
+  struct gif_decoder decoder;
+  int err;
+
+  gif_decoder_init (&decoder, gif, opts);
+
+  if (decoder.flags & GIF_PARSE_LAZY)
+    {
+      gif->src      = (const gu8 *) buf;
+      gif->src_size = size;
+    }
+
+  if ((err = gif_decoder_feed (&decoder, size, buf)))
+    return err;
+
+  return gif_decoder_end (&decoder);
+}
+
+// returns the byte after a run of sub-blocks, or NULL if it is truncated
+static const gu8 *
+gif_skip_sub_blocks (const gu8 *p, const gu8 *end)
+{
+  while (p < end)
+    {
+      gu8 len = *p++;
+
+      if (!len)
+        return p;
+
+      if ((gusize) (end - p) < len)
+        return NULL;
+
+      p += len;
+    }
+
+  return NULL;
+}
+
+int
+gif_probe (gusize size, const char *buf, struct gif_info *info,
+           void (*image) (void *user, const struct gif_image *image),
+           void *user)
+{
+  const gu8 *p = (const gu8 *) buf, *end = p + size;
+  struct gif_frame frame;
+  gu8 is_frame = 0;
+  int version, err;
+
+  memset (info, 0, sizeof (struct gif_info));
+  info->loop_count = -1;
+
+  if (size < 0xD)
+    return GIF_ERR_EOF;
+
+  if ((version = gif_read_version (p)) < 0)
+    return GIF_ERR_BAD_DATA;
+
+  info->version  = version;
+  info->width    = gif_load_u16_le (p + 6);
+  info->height   = gif_load_u16_le (p + 8);
+  info->bg_index = p[0xB];
+
+  if (p[0xA] & 0x80)
+    {
+      info->flags |= GIF_FLAG_GCT;
+      info->gct_colors = 1 << ((p[0xA] & 0x7) + 1);
+
+      if (info->bg_index >= info->gct_colors)
+        return GIF_ERR_BAD_DATA;
+    }
+
+  p += 0xD;
+
+  if ((gusize) (end - p) < info->gct_colors * 3u)
+    return GIF_ERR_EOF;
+
+  p += info->gct_colors * 3;
+
+  for (;;)
+    {
+      if (p == end)
+        return GIF_ERR_EOF;
+
+      switch (*p++)
+        {
+        case 0x2C: // image descriptor
+          {
+            struct gif_image img;
+
+            if (end - p < 9)
+              return GIF_ERR_EOF;
+
+            memset (&img, 0, sizeof (struct gif_image));
+
+            img.x      = gif_load_u16_le (p + 0);
+            img.y      = gif_load_u16_le (p + 2);
+            img.width  = gif_load_u16_le (p + 4);
+            img.height = gif_load_u16_le (p + 6);
+
+            if (!img.width || !img.height
+                || (gu32) img.x + img.width > info->width
+                || (gu32) img.y + img.height > info->height)
+              return GIF_ERR_BAD_DATA;
+
+            if (p[8] & 0x40)
+              img.flags |= GIF_IMAGE_FLAG_INTERLACED;
+
+            if (is_frame)
+              {
+                is_frame = 0;
+                img.flags |= GIF_IMAGE_FLAG_FRAME;
+                img.frame = frame;
+
+                ++info->num_frames;
+                info->duration += frame.delay_time;
+              }
+
+            if (p[8] & 0x80)
+              {
+                img.flags |= GIF_IMAGE_FLAG_LCT;
+                img.lct.num_colors = 1 << ((p[8] & 0x7) + 1);
+              }
+            else if (!(info->flags & GIF_FLAG_GCT))
+              return GIF_ERR_BAD_DATA;
+
+            p += 9;
+
+            if ((gusize) (end - p) < img.lct.num_colors * 3u)
+              return GIF_ERR_EOF;
+
+            img.lct.colors = img.lct.num_colors ? (gu8 *) p : NULL;
+            p += img.lct.num_colors * 3;
+
+            if (end - p < 2)
+              return GIF_ERR_EOF;
+
+            if (p[0] < 2 || p[0] > 8 || !p[1])
+              return GIF_ERR_BAD_DATA;
+
+            img.data_offset = p - (const gu8 *) buf;
+
+            if ((p = gif_skip_sub_blocks (p + 1, end)) == NULL)
+              return GIF_ERR_EOF;
+
+            ++info->num_images;
+
+            if (image != NULL)
+              image (user, &img);
+
+            break;
+          }
+        case 0x21: // ext introducer
+          if (end - p < 2)
+            return GIF_ERR_EOF;
+
+          if (p[0] == 0xF9 && p[1] == 0x4)
+            {
+              if (end - p < 7)
+                return GIF_ERR_EOF;
+
+              if ((err = gif_read_gce (&frame, p + 2)))
+                return err;
+
+              // the block terminator was part of it
+              is_frame = 1;
+              p += 7;
+              break;
+            }
+
+          if (p[0] == 0xFF && p[1] == 11)
+            {
+              if (end - p < 14)
+                return GIF_ERR_EOF;
+
+              if (gif_is_loop_app (p + 2) && p[13] == 3 && end - p >= 17
+                  && p[14] == 1)
+                info->loop_count = gif_load_u16_le (p + 15);
+
+              p += 13;
+            }
+          else
+            ++p;
+
+          if ((p = gif_skip_sub_blocks (p, end)) == NULL)
+            return GIF_ERR_EOF;
+
+          break;
+        case 0x3B: // trailer
+          return GIF_SUCCESS;
+        default: // unknown separator
+          return GIF_ERR_BAD_DATA;
+        }
+    }
+}
+
+/*
+ * Decodes a lazily parsed image to out, rows stride bytes apart. The
+ * offset of the last index must fit in 32 bits.
+ */
+static int
+gif_image_decode_to (struct gif_image *image, gu8 *out, gu32 stride)
 {
-  gusize size;
-  const gu8 *buf;
-};
+  struct gif *gif = image->gif;
+  struct gif_color_table *palette = gif_image_get_palette (image);
+  struct gif_lzw lzw;
+  const gu8 *buf   = gif->src + image->data_offset;
+  gusize size      = gif->src_size - image->data_offset;
+  gu32 num_indices = 0, req_indices = (gu32) image->width * image->height;
+  int result = GIF_LZW_MORE;
+
+  gif_lzw_init (&lzw, image, stride, buf[0], palette->num_colors);
+
+  ++buf;
+  --size;
+
+  // the block structure was validated by gif_parse_ex, the bounds are
+  // checked all the same since the buffer belongs to the caller
+  while (size && *buf && result == GIF_LZW_MORE)
+    {
+      gusize bytes = *buf;
 
-#define LIBGIF_SLOW
+      if (bytes >= size)
+        return GIF_ERR_EOF;
 
-#define VEC_MUST(V, S)                                                        \
-  if ((V).size < (S))                                                         \
-    {                                                                         \
-      gif_free (gif);                                                         \
-      return GIF_ERR_EOF;                                                     \
+      result = gif_lzw_decode (&lzw, buf + 1, bytes, out, &num_indices,
+                               req_indices);
+
+      buf += bytes + 1;
+      size -= bytes + 1;
     }
 
-#define VEC_ADVANCE(V, N)                                                     \
-  do                                                                          \
-    {                                                                         \
-      if ((V).size < (N))                                                     \
-        {                                                                     \
-          gif_free (gif);                                                     \
-          return GIF_ERR_EOF;                                                 \
-        }                                                                     \
-      (V).size -= (N);                                                        \
-      (V).buf += (N);                                                         \
-    }                                                                         \
-  while (0)
+  if (result < 0)
+    return result;
 
-#define VEC_ADVANCE_UNSAFE(V, N)                                              \
-  do                                                                          \
-    {                                                                         \
-      (V).size -= (N);                                                        \
-      (V).buf += (N);                                                         \
-    }                                                                         \
-  while (0)
+  if (num_indices != req_indices)
+    return GIF_ERR_BAD_DATA;
+
+  return GIF_SUCCESS;
+}
+
+// checks that a lazily parsed image can be decoded at all
+static int
+gif_image_check_src (struct gif_image *image)
+{
+  struct gif *gif = image->gif;
+  gu8 min_code_size;
+
+  if (gif->src == NULL || image->data_offset + 2 > gif->src_size
+      || gif_image_get_palette (image) == NULL)
+    return GIF_ERR_FAULT;
+
+  min_code_size = gif->src[image->data_offset];
 
-#define VEC_AT_UNSAFE(V, I) (V).buf[(I)]
+  if (min_code_size < 2 || min_code_size > 8)
+    return GIF_ERR_BAD_DATA;
 
-#define VEC_AT_U16_LE_UNSAFE(V, I) (*(gu16 *) ((V).buf + (I)))
+  return GIF_SUCCESS;
+}
 
 int
-gif_parse (struct gif *gif, gusize size, const char *buf)
+gif_image_decode (struct gif_image *image)
 {
-  struct vec v = (struct vec) { .size = size, .buf = (const gu8 *) buf };
+  struct gif *gif = image->gif;
+  int err;
 
-  memset (gif, 0, sizeof (struct gif));
-
-  VEC_MUST (v, 0xD);
+  if (image->indices != NULL)
+    return GIF_SUCCESS;
 
-  gu8 version_byte = VEC_AT_UNSAFE (v, 4);
+  if ((err = gif_image_check_src (image)))
+    return err;
 
-  if (VEC_AT_UNSAFE (v, 0) != 0x47 || VEC_AT_UNSAFE (v, 1) != 0x49
-      || VEC_AT_UNSAFE (v, 2) != 0x46 || VEC_AT_UNSAFE (v, 3) != 0x38
-      || (version_byte != 0x37 && version_byte != 0x39)
-      || VEC_AT_UNSAFE (v, 5) != 0x61)
-    return GIF_ERR_BAD_DATA;
+  image->indices = gif_mem_alloc (gif, (gusize) image->width * image->height);
+  if (image->indices == NULL)
+    return GIF_ERR_NOMEM;
 
-  switch (version_byte)
+  if ((err = gif_image_decode_to (image, image->indices, image->width)))
     {
-    case 0x37:
-      gif->version = GIF_VERSION_87A;
-      break;
-    case 0x39:
-      gif->version = GIF_VERSION_89A;
-      break;
+      gif_mem_release (gif, image->indices);
+      image->indices = NULL;
     }
 
-  gif->width  = VEC_AT_U16_LE_UNSAFE (v, 6);
-  gif->height = VEC_AT_U16_LE_UNSAFE (v, 8);
+  return err;
+}
+
+int
+gif_image_evict (struct gif_image *image)
+{
+  struct gif *gif = image->gif;
 
-  gif->num_images = 0;
-  gif->images_cap = 0;
-  gif->images     = NULL;
+  if (image->indices == NULL)
+    return GIF_SUCCESS;
 
-  gu8 packed_byte = VEC_AT_UNSAFE (v, 0xA);
-  gif->bg_index
-      = VEC_AT_UNSAFE (v, 0xB); // NOTE: meaningless if GCT not present
+  // only a lazily parsed image can be decoded again, and memory from a
+  // context only goes back with the whole arena
+  if (gif->src == NULL || gif->context != NULL)
+    return GIF_ERR_FAULT;
 
-  VEC_ADVANCE_UNSAFE (v, 0xD);
+  gif_mem_release (gif, image->indices);
+  image->indices = NULL;
 
-  if (packed_byte & 0x80)
+  return GIF_SUCCESS;
+}
+
+struct gif_strided
+{
+  gu8 *dst;
+  gusize stride;
+  gu16 width;
+};
+
+static void
+gif_strided_row (void *ctx, gu16 y, const gu8 *indices)
+{
+  struct gif_strided *strided = ctx;
+
+  memcpy (strided->dst + y * strided->stride, indices, strided->width);
+}
+
+int
+gif_image_decode_into (struct gif_image *image, gu8 *dst, gusize stride)
+{
+  struct gif_strided strided = { dst, stride, image->width };
+  gu64 extent;
+  int err;
+
+  if (stride < image->width)
+    return GIF_ERR_FAULT;
+
+  if (image->indices != NULL)
     {
-      gusize num_bytes;
-      gif->flags |= GIF_FLAG_GCT;
-      gif->gct.num_colors = 1 << ((packed_byte & 0x7) + 1);
+      for (gu16 y = 0; y < image->height; y++)
+        gif_strided_row (&strided, y,
+                         image->indices + (gusize) y * image->width);
 
-      if (gif->bg_index >= gif->gct.num_colors)
-        return GIF_ERR_BAD_DATA;
+      return GIF_SUCCESS;
+    }
 
-      num_bytes = gif->gct.num_colors * 3;
-      VEC_MUST (v, num_bytes);
+  if ((err = gif_image_check_src (image)))
+    return err;
 
-      gif->gct.colors = malloc (num_bytes);
-      if (gif->gct.colors == NULL)
-        return GIF_ERR_NOMEM;
+  // table offsets are 32 bits wide, a buffer too large for them gets its
+  // rows one at a time
+  extent = image->height
+               ? (gu64) stride * (image->height - 1) + image->width
+               : 0;
+
+  if (extent > 0xFFFFFFFF)
+    return gif_image_decode_rows (image, gif_strided_row, &strided);
 
-      memcpy (gif->gct.colors, v.buf, num_bytes);
+  return gif_image_decode_to (image, dst, (gu32) stride);
+}
+
+struct gif_canvas
+{
+  struct gif_lut lut;
+  gu8 *dst;
+  gusize stride;
+  gu16 width;
+  gu8 blend;
+  gu16 x0, y0, x1, y1;
+};
+
+// widens the bounds by columns x0 to x1 (exclusive) of row y
+static inline void
+gif_canvas_bound (struct gif_canvas *canvas, gu16 y, gu16 x0, gu16 x1)
+{
+  if (x0 >= x1)
+    return;
+
+  if (x0 < canvas->x0)
+    canvas->x0 = x0;
+  if (x1 > canvas->x1)
+    canvas->x1 = x1;
+  if (y < canvas->y0)
+    canvas->y0 = y;
+  if (y >= canvas->y1)
+    canvas->y1 = y + 1;
+}
+
+static void
+gif_canvas_row (void *ctx, gu16 y, const gu8 *indices)
+{
+  struct gif_canvas *canvas = ctx;
+  gu8 *dst = canvas->dst + y * canvas->stride;
+  gu16 x0 = canvas->width, x1 = 0;
+
+  if (!canvas->blend)
+    {
+      gif_lut_expand (&canvas->lut, dst, indices, canvas->width);
+      gif_canvas_bound (canvas, y, 0, canvas->width);
+      return;
+    }
+
+  for (gu16 i = 0; i < canvas->width; i++)
+    {
+      const gu8 *px = (const gu8 *) (canvas->lut.colors + indices[i]);
+
+      if (px[3])
+        {
+          memcpy (dst + (gusize) i * 4, px, 4);
 
-      VEC_ADVANCE_UNSAFE (v, num_bytes);
+          if (i < x0)
+            x0 = i;
+          x1 = i + 1;
+        }
     }
 
-  struct gif_frame frame = { 0 };
-  gu8 is_frame           = 0;
+  gif_canvas_bound (canvas, y, x0, x1);
+}
 
-read_block:
-  VEC_MUST (v, 1);
+int
+gif_image_decode_rows (struct gif_image *image,
+                       void (*row) (void *user, gu16 y, const gu8 *indices),
+                       void *user)
+{
+  struct gif *gif = image->gif;
+  struct gif_color_table *palette = gif_image_get_palette (image);
+  const struct gif_allocator *allocator;
+  struct gif_lzw_chain lzw;
+  struct gif_rows rows;
+  const gu8 *buf;
+  gusize size;
+  int result = GIF_LZW_MORE, err = GIF_SUCCESS;
 
-  gu8 separator = VEC_AT_UNSAFE (v, 0);
-  gusize bytes;
+  if (palette == NULL)
+    return GIF_ERR_FAULT;
 
-  switch (separator)
+  if (image->indices != NULL)
     {
-    case 0x2C: // image descriptor
-      {
-        struct gif_image img = { 0 };
-        gu8 is_interlaced    = 0;
-        gu16 num_colors;
+      for (gu16 y = 0; y < image->height; y++)
+        row (user, y, image->indices + (gusize) y * image->width);
 
-        VEC_MUST (v, 0xA);
+      return GIF_SUCCESS;
+    }
 
-        if (gif->num_images == gif->images_cap)
-          {
-            gusize ncap = gif->images_cap + 8;
-            struct gif_image *imgs
-                = realloc (gif->images, ncap * sizeof (struct gif_image));
+  if (gif->src == NULL || image->data_offset + 2 > gif->src_size)
+    return GIF_ERR_FAULT;
 
-            if (imgs == NULL)
-              {
-                gif_free (gif);
-                return GIF_ERR_NOMEM;
-              }
+  buf  = gif->src + image->data_offset;
+  size = gif->src_size - image->data_offset;
 
-            gif->images_cap = ncap;
-            gif->images     = imgs;
-          }
+  if (buf[0] < 2 || buf[0] > 8)
+    return GIF_ERR_BAD_DATA;
 
-        img.gif    = gif;
-        img.x      = VEC_AT_U16_LE_UNSAFE (v, 1);
-        img.y      = VEC_AT_U16_LE_UNSAFE (v, 3);
-        img.width  = VEC_AT_U16_LE_UNSAFE (v, 5);
-        img.height = VEC_AT_U16_LE_UNSAFE (v, 7);
+  allocator = gif_allocator (gif);
+  rows.buf  = allocator->alloc (allocator->user,
+                                gif_rows_size (image->width, image->height));
+  if (rows.buf == NULL)
+    return GIF_ERR_NOMEM;
 
-        if (!img.width || !img.height
-            || (gu32) img.x + (gu32) img.width > (gu32) gif->width
-            || (gu32) img.y + (gu32) img.height > (gu32) gif->height)
-          {
-            printf ("WIDTH/X\n");
-            gif_free (gif);
-            return GIF_ERR_BAD_DATA;
-          }
+  gif_rows_init (&rows, rows.buf, image->width, image->height,
+                 (image->flags & GIF_IMAGE_FLAG_INTERLACED) != 0);
+  rows.emit = row;
+  rows.ctx  = user;
+  gif_lzw_chain_init (&lzw, buf[0], palette->num_colors);
 
-        gu8 packed_byte = VEC_AT_UNSAFE (v, 9);
-        VEC_ADVANCE_UNSAFE (v, 0xA);
+  ++buf;
+  --size;
 
-        if (packed_byte & 0x80)
-          {
-            gusize num_bytes;
+  while (size && *buf && result == GIF_LZW_MORE)
+    {
+      gusize bytes = *buf;
 
-            img.flags |= GIF_IMAGE_FLAG_LCT;
+      if (bytes >= size)
+        {
+          err = GIF_ERR_EOF;
+          break;
+        }
 
-            img.lct.num_colors = 1 << ((packed_byte & 0x7) + 1);
-            num_colors         = img.lct.num_colors;
-            num_bytes          = img.lct.num_colors * 3;
+      result = gif_lzw_chain_decode (&lzw, buf + 1, bytes, &rows);
 
-            VEC_MUST (v, num_bytes);
+      buf += bytes + 1;
+      size -= bytes + 1;
+    }
 
-            img.lct.colors = malloc (num_bytes);
+  allocator->release (allocator->user, rows.buf);
 
-            if (img.lct.colors == NULL)
-              {
-                gif_free (gif);
-                return GIF_ERR_NOMEM;
-              }
+  if (result < 0)
+    return result;
 
-            memcpy (img.lct.colors, v.buf, num_bytes);
+  if (!err && rows.base + rows.fill != rows.max_indices)
+    err = GIF_ERR_BAD_DATA;
 
-            VEC_ADVANCE_UNSAFE (v, num_bytes);
-          }
-        else if (!(gif->flags & GIF_FLAG_GCT))
-          {
-            printf ("NO LCT OR GCT\n");
-            gif_free (gif);
-            return GIF_ERR_BAD_DATA;
-          }
-        else
-          num_colors = gif->gct.num_colors;
+  return err;
+}
 
-        if (packed_byte & 0x40)
-          is_interlaced = 1;
+int
+gif_image_draw (struct gif_image *image, gu8 *canvas, gusize stride)
+{
+  return gif_image_draw_ex (image, canvas, stride, NULL);
+}
 
-        if (is_frame)
-          {
-            is_frame = 0;
-            img.flags |= GIF_IMAGE_FLAG_FRAME;
-            img.frame = frame;
-          }
+int
+gif_image_draw_ex (struct gif_image *image, gu8 *canvas, gusize stride,
+                   struct gif_rect *drawn)
+{
+  struct gif *gif = image->gif;
+  struct gif_color_table *palette = gif_image_get_palette (image);
+  struct gif_canvas ctx;
+  gu8 transparent = (image->frame.flags & GIF_FRAME_FLAG_TRANSPARENT) != 0,
+      code_size   = 8;
+  int err;
+
+  if (palette == NULL)
+    return GIF_ERR_FAULT;
+
+  // without the code size, any palette short of 256 colors may have gap
+  // indices; an invalid one is reported by gif_image_decode_rows
+  if (image->indices == NULL && gif->src != NULL
+      && image->data_offset < gif->src_size
+      && gif->src[image->data_offset] <= 8)
+    code_size = gif->src[image->data_offset];
+
+  // the parser only accepts frames that lie within the logical screen
+  ctx.dst    = canvas + image->y * stride + (gusize) image->x * 4;
+  ctx.stride = stride;
+  ctx.width  = image->width;
+  ctx.blend  = transparent || palette->num_colors < (1 << code_size);
+  ctx.x0     = image->width;
+  ctx.y0     = image->height;
+  ctx.x1 = ctx.y1 = 0;
+
+  gif_lut_init (&ctx.lut, palette,
+                transparent ? image->frame.transparent_index : -1,
+                GIF_FORMAT_RGBA8888);
+
+  err = gif_image_decode_rows (image, gif_canvas_row, &ctx);
+
+  if (drawn != NULL)
+    {
+      if (ctx.x0 < ctx.x1)
+        {
+          drawn->x      = image->x + ctx.x0;
+          drawn->y      = image->y + ctx.y0;
+          drawn->width  = ctx.x1 - ctx.x0;
+          drawn->height = ctx.y1 - ctx.y0;
+        }
+      else
+        memset (drawn, 0, sizeof (struct gif_rect));
+    }
 
-        gif->images[gif->num_images++] = img;
-        struct gif_image *imgp         = gif->images + (gif->num_images - 1);
+  return err;
+}
 
-        VEC_MUST (v, 2);
+/*
+ * Runs num_tasks tasks on up to num_threads threads, the calling thread
+ * included. Tasks are handed out in order and a worker stops taking tasks
+ * once one before its next task has failed, so every task before the first
+ * failure always runs, whatever the scheduling. job->failed is left at the
+ * index of the first failed task, or num_tasks.
+ */
+struct gif_job
+{
+  int (*task) (void *ctx, gu32 i);
+  void *ctx;
+  const struct gif_allocator *allocator;
+  pthread_mutex_t lock;
+  gu32 num_tasks;
+  gu32 next;
+  gu32 failed;
+  int err;
+};
 
-        struct gif_code code_table[4096];
-        gu8 first_code = 1, min_lzw_code_size, lzw_code_size;
-        gu16 prev_code, code = 0, code_off = 0, bit_off = 0, next_code;
-        gu32 num_indices = 0, req_indices = img.width * img.height;
+static void *
+gif_job_worker (void *arg)
+{
+  struct gif_job *job = arg;
 
-        imgp->indices = malloc (sizeof (gu8) * req_indices);
-        if (imgp->indices == NULL)
-          {
-            gif_free (gif);
-            return GIF_ERR_NOMEM;
-          }
+  for (;;)
+    {
+      gu32 i;
+      int err;
 
-        min_lzw_code_size = VEC_AT_UNSAFE (v, 0);
-        lzw_code_size     = min_lzw_code_size + 1;
+      pthread_mutex_lock (&job->lock);
+      i = job->next < job->failed ? job->next++ : job->num_tasks;
+      pthread_mutex_unlock (&job->lock);
 
-        VEC_ADVANCE_UNSAFE (v, 1);
+      if (i == job->num_tasks)
+        break;
 
-        bytes = VEC_AT_UNSAFE (v, 0);
+      if ((err = job->task (job->ctx, i)))
+        {
+          pthread_mutex_lock (&job->lock);
+          if (i < job->failed)
+            {
+              job->failed = i;
+              job->err    = err;
+            }
+          pthread_mutex_unlock (&job->lock);
+        }
+    }
 
-        if (!bytes || (min_lzw_code_size < 2 || min_lzw_code_size > 8))
-          {
-            gif_free (gif);
-            return GIF_ERR_BAD_DATA;
-          }
+  return NULL;
+}
 
-        if (num_colors > (1 << min_lzw_code_size))
-          num_colors = 1 << min_lzw_code_size;
+static int
+gif_job_run (struct gif_job *job, gu32 num_threads)
+{
+  pthread_t *threads = NULL;
+  gu32 num_spawned   = 0;
 
-        gu16 first_next_code = (1 << min_lzw_code_size) + 2;
-        next_code            = first_next_code;
+  job->next   = 0;
+  job->failed = job->num_tasks;
+  job->err    = GIF_SUCCESS;
 
-        gu16 max_color = num_colors;
+  if (pthread_mutex_init (&job->lock, NULL))
+    return GIF_ERR_FAULT;
 
-        // NOTE: non-standard convention that indices that fall in gap
-        // between colors and clear code are transparent
-        // we map num_colors + 1 to a transparent color if a gap exists
-        if (num_colors < (1 << min_lzw_code_size))
-          ++max_color;
+  if (num_threads > job->num_tasks)
+    num_threads = job->num_tasks;
 
-        for (gu16 i = 0; i < max_color; i++)
-          {
-            code_table[i].len         = 1;
-            code_table[i].prefix_code = GIF_CODE_NO_PREFIX;
-            code_table[i].inuse       = 1;
-            code_table[i].index       = i;
-            code_table[i].first_index = i;
-          }
+  if (num_threads > 1)
+    threads = job->allocator->alloc (job->allocator->user,
+                                     (num_threads - 1) * sizeof (pthread_t));
 
-        for (gu16 i = first_next_code; i < 4096; i++)
-          code_table[i].inuse = 0;
+  if (threads != NULL)
+    for (; num_spawned < num_threads - 1; num_spawned++)
+      if (pthread_create (threads + num_spawned, NULL, gif_job_worker, job))
+        break;
 
-        while (bytes)
-          {
-            VEC_MUST (v, bytes + 2);
-            VEC_ADVANCE_UNSAFE (v, 1);
+  gif_job_worker (job);
 
-            // handle code stream
-            while (bytes)
-              {
-                gu8 bits = 8 - bit_off;
-                if (lzw_code_size - code_off < bits)
-                  bits = lzw_code_size - code_off;
-
-                code |= ((VEC_AT_UNSAFE (v, 0) >> bit_off) & ((1 << bits) - 1))
-                        << code_off;
-                bit_off += bits;
-                code_off += bits;
-
-                if (bit_off == 8)
-                  {
-                    bit_off = 0;
-                    --bytes;
-                    VEC_ADVANCE_UNSAFE (v, 1);
-                  }
-
-                if (code_off == lzw_code_size)
-                  {
-                    // EOI code
-                    if (code == (1 << min_lzw_code_size) + 1)
-                      {
-                        if (bytes)
-                          VEC_ADVANCE_UNSAFE (v, bytes);
-                        goto end_code_stream;
-                      }
-
-                    // clear code
-                    if (code == (1 << min_lzw_code_size))
-                      {
-                        first_code    = 1;
-                        lzw_code_size = min_lzw_code_size + 1;
-                        next_code     = first_next_code;
-
-                        // reset code table to initial state
-                        for (gu16 i = first_next_code; i < 4096; i++)
-                          code_table[i].inuse = 0;
-
-                        code     = 0;
-                        code_off = 0;
-
-                        continue;
-                      }
-
-                    if (first_code)
-                      {
-                        if (code >= num_colors)
-                          {
-                            if (code >= first_next_code)
-                              {
-                                printf ("INVALID FIRST CODE\n");
-                                gif_free (gif);
-                                return GIF_ERR_BAD_DATA;
-                              }
-
-                            // if in gap, normalize to transparent index
-                            code = num_colors;
-                          }
-
-                        if (num_indices >= req_indices)
-                          goto end_code_stream;
-
-                        imgp->indices[num_indices++] = code;
-
-                        first_code = 0;
-                        goto end_code;
-                      }
-
-                    gu16 len         = code_table[prev_code].len + 1,
-                         prefix_code = prev_code;
-                    gu8 index;
+  for (gu32 i = 0; i < num_spawned; i++)
+    pthread_join (threads[i], NULL);
 
-#ifdef LIBGIF_SLOW
-                    if (code > 4095)
-                      {
-                        gif_free (gif);
-                        return GIF_ERR_FAULT;
-                      }
-#endif
+  pthread_mutex_destroy (&job->lock);
 
-                    if (code_table[code].inuse)
-                      {
-                        index = code_table[code].first_index;
+  if (threads != NULL)
+    job->allocator->release (job->allocator->user, threads);
 
-                        gu16 tmplen = code_table[code].len, tmpc = code,
-                             tmpi = 0;
-                        gu8 stack[tmplen];
+  return job->err;
+}
 
-                        if (num_indices + tmplen > req_indices)
-                          goto end_code_stream;
+struct gif_decode_images
+{
+  struct gif *gif;
+  gu32 *images;
+};
 
-                        do
-                          {
-#ifdef LIBGIF_SLOW
-                            if (tmpc > 4095 || tmpi >= tmplen)
-                              {
-                                gif_free (gif);
-                                return GIF_ERR_FAULT;
-                              }
-#endif
-                            stack[(tmplen - tmpi++) - 1]
-                                = code_table[tmpc].index;
-                            tmpc = code_table[tmpc].prefix_code;
-                          }
-                        while (tmpc != GIF_CODE_NO_PREFIX);
-
-                        for (gu16 i = 0; i < tmplen; i++)
-                          imgp->indices[num_indices++] = stack[i];
-                      }
-                    else
-                      {
-                        index = code_table[prev_code].first_index;
-
-                        gu16 tmplen = code_table[prev_code].len + 1,
-                             tmpc = prev_code, tmpi = 1;
-                        gu8 stack[tmplen];
-
-                        stack[(tmplen - 1)] = index;
-
-                        if (num_indices + tmplen > req_indices)
-                          goto end_code_stream;
-
-                        do
-                          {
-#ifdef LIBGIF_SLOW
-                            if (tmpc > 4095 || tmpi >= tmplen)
-                              {
-                                gif_free (gif);
-                                return GIF_ERR_FAULT;
-                              }
-#endif
-                            stack[(tmplen - tmpi++) - 1]
-                                = code_table[tmpc].index;
-                            tmpc = code_table[tmpc].prefix_code;
-                          }
-                        while (tmpc != GIF_CODE_NO_PREFIX);
-
-                        for (gu16 i = 0; i < tmplen; i++)
-                          imgp->indices[num_indices++] = stack[i];
-                      }
-
-                    if (num_indices > req_indices)
-                      goto end_code_stream;
-
-                    if (next_code == 4096)
-                      goto end_code;
-
-                    code_table[next_code].len         = len;
-                    code_table[next_code].prefix_code = prefix_code;
-                    code_table[next_code].inuse       = 1;
-                    code_table[next_code].index       = index;
-                    code_table[next_code].first_index
-                        = code_table[prev_code].first_index;
-                    ++next_code;
-
-                    if (next_code == 4096)
-                      goto end_code;
-
-                    if (next_code == (1 << lzw_code_size))
-                      ++lzw_code_size;
-
-                  end_code:
-                    prev_code = code;
-                    code      = 0;
-                    code_off  = 0;
-                  }
-              }
+static int
+gif_decode_images_task (void *ctx, gu32 i)
+{
+  struct gif_decode_images *decode = ctx;
 
-            bytes = VEC_AT_UNSAFE (v, 0);
-          }
+  return gif_image_decode (decode->gif->images + decode->images[i]);
+}
 
-      end_code_stream:
+int
+gif_decode_parallel (struct gif *gif, gu32 num_threads)
+{
+  const struct gif_allocator *allocator = gif_allocator (gif);
+  struct gif_decode_images decode = { .gif = gif };
+  struct gif_job job = { .task      = gif_decode_images_task,
+                         .ctx       = &decode,
+                         .allocator = allocator };
+  int err;
 
-        if (num_indices != req_indices)
-          {
-            printf ("INCOMPLETE IMAGE\n");
-            gif_free (gif);
-            return GIF_ERR_BAD_DATA;
-          }
+  for (gu32 i = 0; i < gif->num_images; i++)
+    if (gif->images[i].indices == NULL)
+      ++job.num_tasks;
 
-        VEC_ADVANCE (v, 1);
+  if (!job.num_tasks)
+    return GIF_SUCCESS;
 
-        if (is_interlaced)
-          {
-            // reconstruct proper indices from interlaced data
-            const gusize indices_len = sizeof (gu8) * req_indices;
-            gu8 *tmpindices          = malloc (indices_len);
+  decode.images
+      = allocator->alloc (allocator->user, job.num_tasks * sizeof (gu32));
+  if (decode.images == NULL)
+    return GIF_ERR_NOMEM;
 
-            if (tmpindices == NULL)
-              {
-                gif_free (gif);
-                return GIF_ERR_NOMEM;
-              }
+  for (gu32 i = 0, j = 0; i < gif->num_images; i++)
+    if (gif->images[i].indices == NULL)
+      decode.images[j++] = i;
 
-            static const gu32 row_increments[] = { 8, 8, 4, 2 };
-            static const gu32 row_offsets[]    = { 0, 4, 2, 1 };
+  err = gif_job_run (&job, num_threads);
 
-            const gu32 row_stride = sizeof (gu8) * imgp->width;
-            gu32 g_row_offset     = 0;
+  // images after the first failure may have been decoded by other workers
+  for (gu32 i = job.failed; i < job.num_tasks; i++)
+    {
+      struct gif_image *image = gif->images + decode.images[i];
 
-            for (gu32 i = 0; i < sizeof (row_increments) / sizeof (gu32); i++)
-              {
-                gu32 row_increment = row_increments[i];
-                gu32 row_offset    = row_offsets[i];
+      gif_mem_release (gif, image->indices);
+      image->indices = NULL;
+    }
 
-                if (imgp->height <= row_offset)
-                  continue;
+  allocator->release (allocator->user, decode.images);
 
-                gu32 num_rows
-                    = ((imgp->height - row_offset) - 1) / row_increment + 1;
+  return err;
+}
 
-                for (gu32 j = 0; j < num_rows; j++)
-                  {
-#ifdef LIBGIF_SLOW
-                    if ((row_increment * j + row_offset) * row_stride
-                            >= indices_len
-                        || (j + g_row_offset) * row_stride >= indices_len)
-                      {
-                        gif_free (gif);
-                        return GIF_ERR_FAULT;
-                      }
-#endif
+/*
+ * A run of codes between two clear codes, which can be decoded without
+ * anything that came before it. offset and len locate its output.
+ */
+struct gif_lzw_segment
+{
+  gusize bit_offset;
+  gu32 offset;
+  gu32 len;
+};
 
-                    memcpy (tmpindices
-                                + (row_increment * j + row_offset)
-                                      * row_stride,
-                            imgp->indices + (j + g_row_offset) * row_stride,
-                            row_stride);
-                  }
+static int
+gif_lzw_scan_push (const struct gif_allocator *allocator,
+                   struct gif_lzw_segment **segs, gu32 *num_segs,
+                   gu32 *segs_cap, const struct gif_lzw_segment *seg)
+{
+  // clear codes in a row produce nothing to decode
+  if (!seg->len)
+    return 1;
 
-                g_row_offset += num_rows;
-              }
+  if (*num_segs == *segs_cap)
+    {
+      gu32 ncap = *segs_cap ? *segs_cap * 2 : 16;
+      struct gif_lzw_segment *nsegs = allocator->resize (
+          allocator->user, *segs, ncap * sizeof (struct gif_lzw_segment));
 
-            memcpy (imgp->indices, tmpindices, indices_len);
-            free (tmpindices);
-          }
+      if (nsegs == NULL)
+        return 0;
 
-        break;
-      }
-    case 0x21: // ext introducer
-      VEC_MUST (v, 3);
+      *segs     = nsegs;
+      *segs_cap = ncap;
+    }
+
+  (*segs)[(*num_segs)++] = *seg;
+
+  return 1;
+}
+
+/*
+ * Walks a whole code stream tracking only string lengths, which is enough
+ * to know where every clear code lands in the output. Returns the number
+ * of non-empty segments, or 0 if the stream should rather be decoded in one
+ * go because it does not fill exactly max_out indices or has an invalid
+ * first code; the regular decoder reports those.
+ */
+static gu32
+gif_lzw_scan (const struct gif_allocator *allocator, const gu8 *buf,
+              gusize size, gu8 min_code_size, gu16 num_colors, gu32 max_out,
+              struct gif_lzw_segment **segments)
+{
+  gu16 lens[GIF_LZW_MAX_CODES];
+  struct gif_lzw_segment *segs = NULL, seg = { 0 };
+  const gu8 *start = buf;
+
+  gu64 bits = 0;
+  gu32 num_bits = 0, code_size = min_code_size + 1,
+       code_mask = (1 << code_size) - 1, num_indices = 0, num_segs = 0,
+       segs_cap = 0;
+  gu32 prev_len = 0;
+  gu8 first_code = 1, valid = 1;
+
+  const gu16 clear_code = 1 << min_code_size, eoi_code = clear_code + 1,
+             first_next_code = clear_code + 2;
+  gu16 next_code = first_next_code, max_color;
+
+  if (num_colors > clear_code)
+    num_colors = clear_code;
 
-      gu8 label = VEC_AT_UNSAFE (v, 1);
+  // see gif_lzw_init
+  max_color = num_colors < clear_code ? num_colors + 1 : num_colors;
 
-      VEC_ADVANCE_UNSAFE (v, 2);
-      bytes = VEC_AT_UNSAFE (v, 0);
+  for (;;)
+    {
+      gu16 code;
+      gu32 len;
 
-      if (label == 0xF9 && bytes == 0x4)
+      if (num_bits < code_size)
         {
-          VEC_MUST (v, bytes + 2);
+          GIF_LZW_REFILL (bits, num_bits, buf, size);
 
-          is_frame = 1;
+          if (num_bits < code_size)
+            break;
+        }
 
-          gu8 packed_byte       = VEC_AT_UNSAFE (v, 1);
-          frame.disposal_method = (packed_byte >> 2) & 7;
+      code = bits & code_mask;
+      bits >>= code_size;
+      num_bits -= code_size;
 
-          if (frame.disposal_method == 0 || frame.disposal_method > 3)
-            frame.disposal_method = GIF_FRAME_DISPOSE_NONE;
+      if (code == eoi_code)
+        break;
 
-          if (packed_byte & 2)
-            frame.flags |= GIF_FRAME_FLAG_USER_INPUT;
+      if (code == clear_code)
+        {
+          seg.len = num_indices - seg.offset;
 
-          if (packed_byte & 1)
+          if (!gif_lzw_scan_push (allocator, &segs, &num_segs, &segs_cap, &seg))
             {
-              frame.flags |= GIF_FRAME_FLAG_TRANSPARENT;
-              frame.transparent_index = VEC_AT_UNSAFE (v, 4);
+              valid = 0;
+              break;
             }
 
-          frame.delay_time = VEC_AT_U16_LE_UNSAFE (v, 2);
+          seg.bit_offset = (gusize) (buf - start) * 8 - num_bits;
+          seg.offset     = num_indices;
 
-          VEC_ADVANCE_UNSAFE (v, bytes + 1);
+          first_code = 1;
+          code_size  = min_code_size + 1;
+          code_mask  = (1 << code_size) - 1;
+          next_code  = first_next_code;
+          continue;
+        }
 
-          if ((bytes = VEC_AT_UNSAFE (v, 0)) != 0)
+      if (first_code)
+        {
+          if (code >= first_next_code)
             {
-              gif_free (gif);
-              return GIF_ERR_BAD_DATA;
+              valid = 0;
+              break;
             }
 
-          VEC_ADVANCE (v, 1);
+          if (num_indices >= max_out)
+            break;
 
-          break;
+          prev_len = 1;
+          ++num_indices;
+          first_code = 0;
+          continue;
         }
 
-      while (bytes)
+      if (code < max_color)
+        len = 1;
+      else if (code >= first_next_code && code < next_code)
+        len = lens[code];
+      else
+        len = prev_len + 1;
+
+      if (len > max_out - num_indices)
+        break;
+
+      if (next_code < GIF_LZW_MAX_CODES)
         {
-          VEC_MUST (v, bytes + 2);
-          VEC_ADVANCE_UNSAFE (v, bytes + 1);
-          bytes = VEC_AT_UNSAFE (v, 0);
-        }
+          lens[next_code++] = prev_len + 1;
 
-      VEC_ADVANCE (v, 1);
+          if (next_code == (1 << code_size) && next_code != GIF_LZW_MAX_CODES)
+            {
+              ++code_size;
+              code_mask = (1 << code_size) - 1;
+            }
+        }
 
-      break;
-    case 0x3B: // trailer
-               // what if v.size > 1?
-      goto finish;
-    default: // unknown separator
-      gif_free (gif);
-      return GIF_ERR_BAD_DATA;
+      prev_len = len;
+      num_indices += len;
     }
 
-  goto read_block;
+  seg.len = num_indices - seg.offset;
+
+  if (valid && !gif_lzw_scan_push (allocator, &segs, &num_segs, &segs_cap, &seg))
+    valid = 0;
+
+  if (!valid || num_indices != max_out)
+    num_segs = 0;
+
+  if (!num_segs && segs != NULL)
+    allocator->release (allocator->user, segs);
+  else
+    *segments = segs;
+
+  return num_segs;
+}
+
+#define GIF_SEGMENT_MIN_RATIO 8
+
+struct gif_decode_segments
+{
+  struct gif_image *image;
+  const gu8 *buf;
+  gusize size;
+  gu8 min_code_size;
+  gu16 num_colors;
+  struct gif_lzw_segment *segments;
+};
+
+static int
+gif_decode_segments_task (void *ctx, gu32 i)
+{
+  struct gif_decode_segments *decode = ctx;
+  struct gif_lzw_segment *seg        = decode->segments + i;
+  struct gif_lzw lzw;
+  gusize byte     = seg->bit_offset >> 3;
+  gu32 num_indices = seg->offset;
+  int result;
+
+  gif_lzw_init (&lzw, decode->image, decode->image->width,
+                decode->min_code_size, decode->num_colors);
+
+  lzw.bits     = decode->buf[byte] >> (seg->bit_offset & 7);
+  lzw.num_bits = 8 - (seg->bit_offset & 7);
+
+  result = gif_lzw_decode (&lzw, decode->buf + byte + 1,
+                           decode->size - byte - 1,
+                           decode->image->indices, &num_indices,
+                           seg->offset + seg->len);
+
+  if (result < 0)
+    return result;
+
+  // the scan and the decoder disagree, which should never happen
+  if (num_indices != seg->offset + seg->len)
+    return GIF_ERR_FAULT;
 
-finish:
   return GIF_SUCCESS;
 }
 
-void
-gif_free (struct gif *gif)
+int
+gif_image_decode_parallel (struct gif_image *image, gu32 num_threads)
 {
-  if (gif->flags & GIF_FLAG_GCT)
-    free (gif->gct.colors);
+  struct gif *gif = image->gif;
+  struct gif_color_table *palette;
+  struct gif_decode_segments decode = { .image = image };
+  const struct gif_allocator *allocator = gif_allocator (gif);
+  struct gif_job job = { .task      = gif_decode_segments_task,
+                         .ctx       = &decode,
+                         .allocator = allocator };
+  const gu8 *buf, *p;
+  gusize size, left;
+  gu8 *stream, *q;
+  int err;
+
+  if (image->indices != NULL || num_threads < 2)
+    return gif_image_decode (image);
+
+  if (gif->src == NULL || image->data_offset + 2 > gif->src_size
+      || (palette = gif_image_get_palette (image)) == NULL)
+    return GIF_ERR_FAULT;
+
+  buf  = gif->src + image->data_offset;
+  size = gif->src_size - image->data_offset;
+
+  decode.min_code_size = buf[0];
+  decode.num_colors    = palette->num_colors;
+
+  if (decode.min_code_size < 2 || decode.min_code_size > 8)
+    return GIF_ERR_BAD_DATA;
 
-  for (gu32 i = 0; i < gif->num_images; i++)
+  // segments start at arbitrary bits, so the sub-blocks are joined into
+  // one contiguous code stream first
+  for (p = buf + 1, left = size - 1; left && *p && *p < left;
+       left -= *p + 1, p += *p + 1)
+    decode.size += *p;
+
+  // the scan costs about as much per code as decoding does, splitting only
+  // pays off when codes expand to long strings on average
+  if ((gu64) image->width * image->height
+      < (gu64) decode.size * GIF_SEGMENT_MIN_RATIO)
+    return gif_image_decode (image);
+
+  if ((stream = allocator->alloc (allocator->user, decode.size + 1)) == NULL)
+    return GIF_ERR_NOMEM;
+
+  decode.buf = q = stream;
+
+  for (p = buf + 1, left = size - 1; left && *p && *p < left;
+       left -= *p + 1, p += *p + 1)
+    {
+      memcpy (q, p + 1, *p);
+      q += *p;
+    }
+
+  job.num_tasks = gif_lzw_scan (allocator, decode.buf, decode.size,
+                                decode.min_code_size, decode.num_colors,
+                                (gu32) image->width * image->height,
+                                &decode.segments);
+
+  if (job.num_tasks < 2)
     {
-      struct gif_image *img = gif->images + i;
+      if (decode.segments != NULL)
+        allocator->release (allocator->user, decode.segments);
+
+      allocator->release (allocator->user, stream);
+      return gif_image_decode (image);
+    }
 
-      if (img->flags & GIF_IMAGE_FLAG_LCT)
-        free (img->lct.colors);
+  image->indices = gif_mem_alloc (gif, (gusize) image->width * image->height);
 
-      free (img->indices);
+  if (image->indices == NULL)
+    err = GIF_ERR_NOMEM;
+  else
+    err = gif_job_run (&job, num_threads);
+
+  if (err)
+    {
+      gif_mem_release (gif, image->indices);
+      image->indices = NULL;
     }
 
-  if (gif->num_images)
-    free (gif->images);
+  allocator->release (allocator->user, decode.segments);
+  allocator->release (allocator->user, stream);
+
+  return err;
+}
+
+void
+gif_free (struct gif *gif)
+{
+  // everything taken from a context goes back to it at once
+  if (gif->context == NULL)
+    {
+      if (gif->flags & GIF_FLAG_GCT)
+        gif_mem_release (gif, gif->gct.colors);
+
+      for (gu32 i = 0; i < gif->num_images; i++)
+        {
+          struct gif_image *img = gif->images + i;
+
+          if (img->flags & GIF_IMAGE_FLAG_LCT)
+            gif_mem_release (gif, img->lct.colors);
+
+          gif_mem_release (gif, img->indices);
+        }
+
+      gif_mem_release (gif, gif->images);
+    }
+  else
+    gif_context_release (gif->context);
 
   memset (gif, 0, sizeof (struct gif));
 }
@@ -630,6 +3099,10 @@ gif_strerr (int gif_err)
       return "GIF invalid data";
     case GIF_ERR_FAULT:
       return "internal error";
+    case GIF_ERR_IO:
+      return "failed to read file";
+    case GIF_ERR_LIMIT:
+      return "GIF exceeds parse limits";
     default:
       return "unknown error";
     }
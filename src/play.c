@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2025 Zachary Lamb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gif.h"
+
+struct gif_player_slot
+{
+  gu8 *canvas;
+  gu32 frame;
+  gu16 delay_time;
+  gu64 start;
+};
+
+/*
+ * The slots form a ring of depth canvases. ready counts the composited ones
+ * from head on, the one held by the caller included, and the worker draws
+ * into the one after them as long as there is room.
+ */
+struct gif_player
+{
+  struct gif_compositor comp;
+  const struct gif_allocator *allocator;
+  struct gif_player_slot *slots;
+  gu32 depth, head, ready;
+  gu8 held, stop, running;
+  int err;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+};
+
+static void *
+gif_player_alloc (struct gif_player *player, gusize size)
+{
+  if (player->allocator == NULL)
+    return malloc (size);
+
+  return player->allocator->alloc (player->allocator->user, size);
+}
+
+static void
+gif_player_release_mem (struct gif_player *player, void *ptr)
+{
+  if (player->allocator == NULL)
+    free (ptr);
+  else if (ptr != NULL)
+    player->allocator->release (player->allocator->user, ptr);
+}
+
+// the compositor belongs to the worker, only the ring is shared
+static void *
+gif_player_worker (void *arg)
+{
+  struct gif_player *player = arg;
+  struct gif_compositor *comp = &player->comp;
+  gusize size = (gusize) comp->gif->width * comp->gif->height * 4;
+  gu64 time   = 0;
+
+  for (;;)
+    {
+      struct gif_player_slot *slot;
+      int err;
+
+      pthread_mutex_lock (&player->lock);
+      while (!player->stop && player->ready == player->depth)
+        pthread_cond_wait (&player->cond, &player->lock);
+
+      if (player->stop)
+        {
+          pthread_mutex_unlock (&player->lock);
+          break;
+        }
+
+      slot = player->slots + (player->head + player->ready) % player->depth;
+      pthread_mutex_unlock (&player->lock);
+
+      if (!(err = gif_compositor_next (comp)))
+        {
+          memcpy (slot->canvas, comp->canvas, size);
+          slot->frame      = comp->frame;
+          slot->delay_time = comp->gif->images[comp->frame].frame.delay_time;
+          slot->start      = time;
+          time += slot->delay_time;
+        }
+
+      pthread_mutex_lock (&player->lock);
+      if (err)
+        player->err = err;
+      else
+        ++player->ready;
+      pthread_cond_broadcast (&player->cond);
+      pthread_mutex_unlock (&player->lock);
+
+      if (err)
+        break;
+    }
+
+  return NULL;
+}
+
+struct gif_player *
+gif_player_create (struct gif *gif, gu32 depth)
+{
+  struct gif_player *player;
+  gusize size = (gusize) gif->width * gif->height * 4;
+
+  if (!gif->num_images)
+    return NULL;
+
+  // one slot is held by the caller, another is drawn meanwhile
+  if (depth < 2)
+    depth = 2;
+
+  player = gif->allocator == NULL
+               ? malloc (sizeof (struct gif_player))
+               : gif->allocator->alloc (gif->allocator->user,
+                                        sizeof (struct gif_player));
+  if (player == NULL)
+    return NULL;
+
+  memset (player, 0, sizeof (struct gif_player));
+  player->allocator = gif->allocator;
+
+  if (gif_compositor_init (&player->comp, gif))
+    goto fail;
+
+  player->slots
+      = gif_player_alloc (player, depth * sizeof (struct gif_player_slot));
+  if (player->slots == NULL)
+    goto fail;
+
+  memset (player->slots, 0, depth * sizeof (struct gif_player_slot));
+  player->depth = depth;
+
+  for (gu32 i = 0; i < depth; i++)
+    if ((player->slots[i].canvas = gif_player_alloc (player, size)) == NULL)
+      goto fail;
+
+  if (pthread_mutex_init (&player->lock, NULL))
+    goto fail;
+
+  if (pthread_cond_init (&player->cond, NULL))
+    {
+      pthread_mutex_destroy (&player->lock);
+      goto fail;
+    }
+
+  if (pthread_create (&player->thread, NULL, gif_player_worker, player))
+    {
+      pthread_cond_destroy (&player->cond);
+      pthread_mutex_destroy (&player->lock);
+      goto fail;
+    }
+
+  player->running = 1;
+
+  return player;
+
+fail:
+  gif_player_destroy (player);
+  return NULL;
+}
+
+int
+gif_player_swap (struct gif_player *player, struct gif_player_frame *frame,
+                 int wait)
+{
+  struct gif_player_slot *slot;
+  gu32 need;
+
+  pthread_mutex_lock (&player->lock);
+
+  need = player->held + 1;
+
+  while (wait && player->ready < need && !player->err)
+    pthread_cond_wait (&player->cond, &player->lock);
+
+  // frames drawn before an error are still handed out
+  if (player->ready < need)
+    {
+      int err = player->err;
+
+      pthread_mutex_unlock (&player->lock);
+      return err;
+    }
+
+  if (player->held)
+    {
+      player->head = (player->head + 1) % player->depth;
+      --player->ready;
+      pthread_cond_broadcast (&player->cond);
+    }
+
+  player->held = 1;
+  slot         = player->slots + player->head;
+
+  pthread_mutex_unlock (&player->lock);
+
+  frame->canvas     = slot->canvas;
+  frame->frame      = slot->frame;
+  frame->delay_time = slot->delay_time;
+  frame->start      = slot->start;
+
+  return 1;
+}
+
+void
+gif_player_destroy (struct gif_player *player)
+{
+  if (player == NULL)
+    return;
+
+  if (player->running)
+    {
+      pthread_mutex_lock (&player->lock);
+      player->stop = 1;
+      pthread_cond_broadcast (&player->cond);
+      pthread_mutex_unlock (&player->lock);
+
+      pthread_join (player->thread, NULL);
+      pthread_cond_destroy (&player->cond);
+      pthread_mutex_destroy (&player->lock);
+    }
+
+  if (player->slots != NULL)
+    for (gu32 i = 0; i < player->depth; i++)
+      gif_player_release_mem (player, player->slots[i].canvas);
+
+  gif_player_release_mem (player, player->slots);
+
+  if (player->comp.canvas != NULL)
+    gif_compositor_free (&player->comp);
+
+  gif_player_release_mem (player, player);
+}
@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2025 Zachary Lamb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Checks that the ways of parsing a file agree with a plain gif_parse:
+ *
+ *   check feed FILE      gif_decoder_feed in small chunks
+ *   check lazy FILE      GIF_PARSE_LAZY followed by gif_image_decode
+ *   check validate FILE  GIF_PARSE_VALIDATE, on the file and its prefixes
+ *   check probe FILE     gif_probe
+ *   check into FILE      gif_image_decode_into at a stride past the width
+ *   check rows FILE      gif_image_decode_rows into a strided buffer
+ *   check parallel FILE  gif_decode_parallel and gif_image_decode_parallel
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gif.h"
+
+static int
+check_same_images (struct gif *a, struct gif *b)
+{
+  if (a->width != b->width || a->height != b->height
+      || a->num_images != b->num_images || a->loop_count != b->loop_count)
+    return -1;
+
+  for (gu32 i = 0; i < a->num_images; i++)
+    {
+      struct gif_image *x = a->images + i, *y = b->images + i;
+
+      if (x->x != y->x || x->y != y->y || x->width != y->width
+          || x->height != y->height || x->flags != y->flags
+          || x->frame.disposal_method != y->frame.disposal_method
+          || x->frame.delay_time != y->frame.delay_time
+          || x->indices == NULL || y->indices == NULL
+          || memcmp (x->indices, y->indices,
+                     (gusize) x->width * x->height))
+        {
+          fprintf (stderr, "image %u differs\n", (unsigned) i);
+          return -1;
+        }
+    }
+
+  return 0;
+}
+
+static int
+check_feed (const struct gif_file *file, struct gif *ref)
+{
+  static const gusize chunks[] = { 1, 2, 7, 255, 4096 };
+  int result = 0;
+
+  for (gusize c = 0; c < sizeof (chunks) / sizeof (chunks[0]) && !result; c++)
+    {
+      struct gif gif = { 0 };
+      struct gif_decoder *decoder = gif_decoder_create (&gif);
+      int err = GIF_SUCCESS;
+
+      if (decoder == NULL)
+        return -1;
+
+      for (gusize off = 0; off < file->size && !err; off += chunks[c])
+        {
+          gusize n = file->size - off < chunks[c] ? file->size - off
+                                                  : chunks[c];
+
+          err = gif_decoder_feed (decoder, n, (const char *) file->data + off);
+        }
+
+      if (!err)
+        err = gif_decoder_finish (decoder);
+      else
+        gif_decoder_finish (decoder);
+
+      if (err || check_same_images (ref, &gif))
+        {
+          fprintf (stderr, "feeding %zu bytes at a time: '%s'\n", chunks[c],
+                   gif_strerr (err));
+          result = -1;
+        }
+
+      gif_free (&gif);
+    }
+
+  return result;
+}
+
+static int
+check_lazy (const struct gif_file *file, struct gif *ref)
+{
+  struct gif_parse_options opts = { 0 };
+  struct gif gif = { 0 };
+  int err;
+
+  opts.flags = GIF_PARSE_LAZY;
+
+  err = gif_parse_ex (&gif, file->size, (const char *) file->data, &opts);
+
+  for (gu32 i = 0; !err && i < gif.num_images; i++)
+    err = gif_image_decode (gif.images + i);
+
+  if (!err)
+    err = check_same_images (ref, &gif);
+
+  gif_free (&gif);
+
+  return err;
+}
+
+static int
+check_validate (const struct gif_file *file)
+{
+  struct gif_parse_options opts = { 0 };
+
+  opts.flags = GIF_PARSE_VALIDATE;
+
+  // prefixes cover truncation at every kind of block
+  for (gusize size = file->size;; size = size * 7 / 8)
+    {
+      struct gif parsed = { 0 }, validated = { 0 };
+      int expect = gif_parse (&parsed, size, (const char *) file->data);
+      int got    = gif_parse_ex (&validated, size, (const char *) file->data,
+                                 &opts);
+
+      gif_free (&parsed);
+      gif_free (&validated);
+
+      if (expect != got)
+        {
+          fprintf (stderr, "%zu bytes: parse says '%s', validate '%s'\n",
+                   size, gif_strerr (expect), gif_strerr (got));
+          return -1;
+        }
+
+      if (!size)
+        break;
+    }
+
+  return 0;
+}
+
+static int
+check_probe (const struct gif_file *file, struct gif *ref)
+{
+  struct gif_info info;
+  gu32 num_frames = 0;
+  gu64 duration   = 0;
+  int err;
+
+  if ((err = gif_probe (file->size, (const char *) file->data, &info, NULL,
+                        NULL)))
+    {
+      fprintf (stderr, "probe: '%s'\n", gif_strerr (err));
+      return -1;
+    }
+
+  for (gu32 i = 0; i < ref->num_images; i++)
+    if (ref->images[i].flags & GIF_IMAGE_FLAG_FRAME)
+      {
+        ++num_frames;
+        duration += ref->images[i].frame.delay_time;
+      }
+
+  if (info.width != ref->width || info.height != ref->height
+      || info.num_images != ref->num_images || info.num_frames != num_frames
+      || info.duration != duration || info.loop_count != ref->loop_count)
+    {
+      fprintf (stderr, "probe counts differ from the parse\n");
+      return -1;
+    }
+
+  return 0;
+}
+
+#define CHECK_PAD    13
+#define CHECK_FILLER 0xA5
+
+struct check_rows
+{
+  gu8 *dst;
+  gusize stride;
+  gu16 width;
+};
+
+static void
+check_row (void *user, gu16 y, const gu8 *indices)
+{
+  struct check_rows *rows = user;
+
+  memcpy (rows->dst + y * rows->stride, indices, rows->width);
+}
+
+/*
+ * Compares rows stride bytes apart against the reference indices, and
+ * checks that the padding past each row was left alone.
+ */
+static int
+check_strided (const gu8 *buf, gusize stride, const struct gif_image *ref)
+{
+  for (gu16 y = 0; y < ref->height; y++)
+    {
+      const gu8 *row = buf + y * stride;
+
+      if (memcmp (row, ref->indices + (gusize) y * ref->width, ref->width))
+        return -1;
+
+      for (gusize x = ref->width; x < stride; x++)
+        if (row[x] != CHECK_FILLER)
+          return -1;
+    }
+
+  return 0;
+}
+
+/*
+ * Decodes every image of a lazily parsed gif at a stride wider than the
+ * image, through gif_image_decode_into or gif_image_decode_rows.
+ */
+static int
+check_strides (const struct gif_file *file, struct gif *ref, int rows)
+{
+  struct gif_parse_options opts = { 0 };
+  struct gif gif = { 0 };
+  int err;
+
+  opts.flags = GIF_PARSE_LAZY;
+
+  if ((err = gif_parse_ex (&gif, file->size, (const char *) file->data,
+                           &opts)))
+    return -1;
+
+  for (gu32 i = 0; !err && i < gif.num_images; i++)
+    {
+      struct gif_image *image = gif.images + i;
+      gusize stride = (gusize) image->width + CHECK_PAD;
+      gu8 *buf = malloc (stride * image->height);
+
+      if (buf == NULL)
+        {
+          err = GIF_ERR_NOMEM;
+          break;
+        }
+
+      memset (buf, CHECK_FILLER, stride * image->height);
+
+      if (rows)
+        {
+          struct check_rows ctx = { buf, stride, image->width };
+          err = gif_image_decode_rows (image, check_row, &ctx);
+        }
+      else
+        err = gif_image_decode_into (image, buf, stride);
+
+      if (!err && check_strided (buf, stride, ref->images + i))
+        {
+          fprintf (stderr, "image %u differs\n", (unsigned) i);
+          err = -1;
+        }
+
+      free (buf);
+    }
+
+  gif_free (&gif);
+
+  return err;
+}
+
+#define CHECK_THREADS 4
+
+static int
+check_same_indices (struct gif *gif, struct gif *ref)
+{
+  for (gu32 i = 0; i < gif->num_images; i++)
+    {
+      struct gif_image *image = gif->images + i;
+
+      if (image->indices == NULL
+          || memcmp (image->indices, ref->images[i].indices,
+                     (gusize) image->width * image->height))
+        {
+          fprintf (stderr, "image %u differs\n", (unsigned) i);
+          return -1;
+        }
+    }
+
+  return 0;
+}
+
+/*
+ * Decodes a lazily parsed copy once across images and once within each
+ * image, where the code stream is split at its clear codes.
+ */
+static int
+check_parallel (const struct gif_file *file, struct gif *ref)
+{
+  struct gif_parse_options opts = { 0 };
+  int result = 0;
+
+  opts.flags = GIF_PARSE_LAZY;
+
+  for (int within = 0; within < 2 && !result; within++)
+    {
+      struct gif gif = { 0 };
+      int err;
+
+      err = gif_parse_ex (&gif, file->size, (const char *) file->data, &opts);
+
+      if (!err && within)
+        for (gu32 i = 0; !err && i < gif.num_images; i++)
+          err = gif_image_decode_parallel (gif.images + i, CHECK_THREADS);
+      else if (!err)
+        err = gif_decode_parallel (&gif, CHECK_THREADS);
+
+      if (err)
+        fprintf (stderr, "decoding in parallel: '%s'\n", gif_strerr (err));
+
+      if (err || check_same_indices (&gif, ref))
+        result = -1;
+
+      gif_free (&gif);
+    }
+
+  return result;
+}
+
+int
+main (int argc, const char *argv[])
+{
+  struct gif_file file = { 0 };
+  struct gif ref       = { 0 };
+  int result, err;
+
+  if (argc != 3)
+    {
+      fprintf (stderr, "usage: check "
+                       "feed|lazy|validate|probe|into|rows|parallel FILE\n");
+      return 1;
+    }
+
+  if ((err = gif_file_open (&file, argv[2])))
+    {
+      fprintf (stderr, "failed to open '%s'\n", argv[2]);
+      return 1;
+    }
+
+  if ((err = gif_parse (&ref, file.size, (const char *) file.data)))
+    {
+      fprintf (stderr, "failed to parse gif: '%s'\n", gif_strerr (err));
+      gif_file_close (&file);
+      return 1;
+    }
+
+  if (!strcmp (argv[1], "feed"))
+    result = check_feed (&file, &ref);
+  else if (!strcmp (argv[1], "lazy"))
+    result = check_lazy (&file, &ref);
+  else if (!strcmp (argv[1], "validate"))
+    result = check_validate (&file);
+  else if (!strcmp (argv[1], "probe"))
+    result = check_probe (&file, &ref);
+  else if (!strcmp (argv[1], "into"))
+    result = check_strides (&file, &ref, 0);
+  else if (!strcmp (argv[1], "rows"))
+    result = check_strides (&file, &ref, 1);
+  else if (!strcmp (argv[1], "parallel"))
+    result = check_parallel (&file, &ref);
+  else
+    {
+      fprintf (stderr, "unknown check '%s'\n", argv[1]);
+      result = -1;
+    }
+
+  gif_free (&ref);
+  gif_file_close (&file);
+
+  return result ? 1 : 0;
+}